@@ -1,175 +1,553 @@
+#include <limits.h>
 #include <string.h>
 #include "huffman.h"
 
-static void HuffmanBubbleSort(HuffmanConstructNode **ppList, int Size);
+static void HuffmanBuildMultiLut(Huffman *hf);
+static void HuffmanBuildEncodeLut(Huffman *hf);
+static unsigned HuffmanSubtreeDepth(const Huffman *hf, unsigned Node);
+static void HuffmanStoreBits(unsigned char *pDst, unsigned long Bits);
+static int HuffmanDecompressLong(const Huffman *hf, const unsigned char *pSrc, const unsigned char *pSrcEnd, unsigned long Bits, unsigned Bitcount,
+	unsigned char *pOutput, unsigned char *pDst, unsigned char *pDstEnd);
+static int HuffmanDecompressFrom(const Huffman *hf, const unsigned char *pSrc, const unsigned char *pSrcEnd, unsigned long Bits, unsigned Bitcount,
+	unsigned char *pOutput, unsigned char *pDst, unsigned char *pDstEnd);
+static unsigned long HuffmanLoadBits(const unsigned char *pSrc);
 
-void HuffmanSetbits_r(Huffman *hf, HuffmanNode *pNode, int Bits, unsigned Depth)
+/* the decode steps are used from several loops, keep them inlined in all of them */
+#if defined(__GNUC__)
+#define HUFFMAN_INLINE __inline__ __attribute__((always_inline))
+#else
+#define HUFFMAN_INLINE
+#endif
+
+/* decoding state of one stream in HuffmanDecompressFast and HuffmanDecompressBatch */
+typedef struct
 {
-	if(pNode->m_aLeafs[1] != 0xffff)
-		HuffmanSetbits_r(hf, &hf->m_aNodes[pNode->m_aLeafs[1]], Bits|(1<<Depth), Depth+1);
-	if(pNode->m_aLeafs[0] != 0xffff)
-		HuffmanSetbits_r(hf, &hf->m_aNodes[pNode->m_aLeafs[0]], Bits, Depth+1);
+	const unsigned char *m_pSrc;
+	const unsigned char *m_pSrcEnd;
+	unsigned char *m_pOutput;
+	unsigned char *m_pDst;
+	unsigned char *m_pDstEnd;
+	unsigned long m_Bits;
+	unsigned m_Bitcount;
+} HuffmanFastLane;
+
+/* width of the bit accumulator used by HuffmanCompress and HuffmanDecompressFast */
+#define HUFFMAN_ACCBITS (sizeof(unsigned long)*CHAR_BIT)
+
+/* compressed size below which HuffmanDecompressBatch doesn't put a packet into a lane,
+   that's around 40 bytes of output with the default table */
+#define HUFFMAN_BATCH_MININPUT 24
 
-	if(pNode->m_NumBits)
+void HuffmanSetbits_r(Huffman *hf, int Node, unsigned Bits, unsigned Depth)
+{
+	if(Node < HUFFMAN_MAX_SYMBOLS)
 	{
-		pNode->m_Bits = Bits;
-		pNode->m_NumBits = Depth;
+		hf->m_aCodeBits[Node] = Bits;
+		hf->m_aCodeLengths[Node] = (unsigned short)Depth;
+		return;
 	}
+
+	/* codes can't be longer than 32 bits, deeper trees from degenerate frequencies lose the high bits.
+	   HuffmanCompress refuses input with any symbol longer than HUFFMAN_FAST_MAXBITS */
+	HuffmanSetbits_r(hf, hf->m_aaLeafs[Node-HUFFMAN_MAX_SYMBOLS][1], Depth < 32 ? Bits|(1u<<Depth) : Bits, Depth+1);
+	HuffmanSetbits_r(hf, hf->m_aaLeafs[Node-HUFFMAN_MAX_SYMBOLS][0], Bits, Depth+1);
 }
 
-static void HuffmanBubbleSort(HuffmanConstructNode **ppList, int Size)
+/* heap order: lowest frequency first and the newest node on ties.
+   this is the order the stable bubble sort of the reference implementation picks the nodes in,
+   so the trees stay identical to the ones teeworlds builds */
+static int HuffmanConstructLess(const HuffmanConstructNode *pA, const HuffmanConstructNode *pB)
 {
-	int Changed = 1;
-	int i;
-	HuffmanConstructNode *pTemp;
+	if(pA->m_Frequency != pB->m_Frequency)
+		return pA->m_Frequency < pB->m_Frequency;
+	return pA->m_NodeId > pB->m_NodeId;
+}
+
+static void HuffmanHeapPush(HuffmanConstructNode *pHeap, int *pSize, HuffmanConstructNode Node)
+{
+	int i = (*pSize)++;
 
-	while(Changed)
+	while(i > 0 && HuffmanConstructLess(&Node, &pHeap[(i-1)/2]))
 	{
-		Changed = 0;
-		for(i = 0; i < Size-1; i++)
-		{
-			if(ppList[i]->m_Frequency < ppList[i+1]->m_Frequency)
-			{
-				pTemp = ppList[i];
-				ppList[i] = ppList[i+1];
-				ppList[i+1] = pTemp;
-				Changed = 1;
-			}
-		}
-		Size--;
+		pHeap[i] = pHeap[(i-1)/2];
+		i = (i-1)/2;
 	}
+	pHeap[i] = Node;
 }
 
-void HuffmanConstructTree(Huffman *hf)
+static HuffmanConstructNode HuffmanHeapPop(HuffmanConstructNode *pHeap, int *pSize)
 {
-	HuffmanConstructNode aNodesLeftStorage[HUFFMAN_MAX_SYMBOLS];
-	HuffmanConstructNode *apNodesLeft[HUFFMAN_MAX_SYMBOLS];
-	int NumNodesLeft = HUFFMAN_MAX_SYMBOLS;
+	HuffmanConstructNode Top = pHeap[0];
+	HuffmanConstructNode Last = pHeap[--(*pSize)];
+	int i = 0;
+
+	while(2*i+1 < *pSize)
+	{
+		int Child = 2*i+1;
+		if(Child+1 < *pSize && HuffmanConstructLess(&pHeap[Child+1], &pHeap[Child]))
+			Child++;
+		if(!HuffmanConstructLess(&pHeap[Child], &Last))
+			break;
+		pHeap[i] = pHeap[Child];
+		i = Child;
+	}
+	pHeap[i] = Last;
+
+	return Top;
+}
+
+void HuffmanConstructTree(Huffman *hf, const unsigned *pFrequencies)
+{
+	HuffmanConstructNode aHeap[HUFFMAN_MAX_SYMBOLS];
+	HuffmanConstructNode Node;
+	int HeapSize = 0;
+	int NumNodes = HUFFMAN_MAX_SYMBOLS;
 	int i;
 
 	/* add the symbols */
 	for(i = 0; i < HUFFMAN_MAX_SYMBOLS; i++)
 	{
-		hf->m_aNodes[i].m_NumBits = 0xFFFFFFFF;
-		hf->m_aNodes[i].m_Symbol = i;
-		hf->m_aNodes[i].m_aLeafs[0] = 0xffff;
-		hf->m_aNodes[i].m_aLeafs[1] = 0xffff;
-
 		if(i == HUFFMAN_EOF_SYMBOL)
-			aNodesLeftStorage[i].m_Frequency = 1;
+			Node.m_Frequency = 1;
 		else
-			aNodesLeftStorage[i].m_Frequency = HuffmanFreqTable[i];
-		aNodesLeftStorage[i].m_NodeId = i;
-		apNodesLeft[i] = &aNodesLeftStorage[i];
-
+			Node.m_Frequency = pFrequencies[i];
+		Node.m_NodeId = i;
+		HuffmanHeapPush(aHeap, &HeapSize, Node);
 	}
 
-	hf->m_NumNodes = HUFFMAN_MAX_SYMBOLS;
-
-	/* construct the table */
-	while(NumNodesLeft > 1)
+	/* construct the table, always merging the two smallest nodes */
+	while(HeapSize > 1)
 	{
-		/* we can't rely on stdlib's qsort for this, it can generate different results on different implementations */
-		HuffmanBubbleSort(apNodesLeft, NumNodesLeft);
+		HuffmanConstructNode Leaf0 = HuffmanHeapPop(aHeap, &HeapSize);
+		HuffmanConstructNode Leaf1 = HuffmanHeapPop(aHeap, &HeapSize);
+
+		hf->m_aaLeafs[NumNodes-HUFFMAN_MAX_SYMBOLS][0] = Leaf0.m_NodeId;
+		hf->m_aaLeafs[NumNodes-HUFFMAN_MAX_SYMBOLS][1] = Leaf1.m_NodeId;
 
-		hf->m_aNodes[hf->m_NumNodes].m_NumBits = 0;
-		hf->m_aNodes[hf->m_NumNodes].m_aLeafs[0] = apNodesLeft[NumNodesLeft-1]->m_NodeId;
-		hf->m_aNodes[hf->m_NumNodes].m_aLeafs[1] = apNodesLeft[NumNodesLeft-2]->m_NodeId;
-		apNodesLeft[NumNodesLeft-2]->m_NodeId = hf->m_NumNodes;
-		apNodesLeft[NumNodesLeft-2]->m_Frequency = apNodesLeft[NumNodesLeft-1]->m_Frequency + apNodesLeft[NumNodesLeft-2]->m_Frequency;
+		Node.m_NodeId = NumNodes;
+		Node.m_Frequency = Leaf0.m_Frequency + Leaf1.m_Frequency;
+		HuffmanHeapPush(aHeap, &HeapSize, Node);
 
-		hf->m_NumNodes++;
-		NumNodesLeft--;
+		NumNodes++;
 	}
 
 	/* set start node */
-	hf->m_pStartNode = &hf->m_aNodes[hf->m_NumNodes-1];
+	hf->m_StartNode = (unsigned short)(NumNodes-1);
 
 	/* build symbol bits */
-	HuffmanSetbits_r(hf, hf->m_pStartNode, 0, 0);
+	HuffmanSetbits_r(hf, hf->m_StartNode, 0, 0);
 }
 
-void HuffmanInit(Huffman *hf)
+void HuffmanInit(Huffman *hf, const unsigned *pFrequencies)
 {
+	unsigned Depth;
 	int i;
 
 	/* make sure to cleanout every thing */
 	memset(hf, 0, sizeof(*hf));
 
 	/* construct the tree */
-	HuffmanConstructTree(hf);
+	HuffmanConstructTree(hf, pFrequencies ? pFrequencies : HuffmanFreqTable);
+
+	for(i = 0; i < HUFFMAN_MAX_SYMBOLS; i++)
+		if(hf->m_aCodeLengths[i] > hf->m_MaxCodeLength)
+			hf->m_MaxCodeLength = hf->m_aCodeLengths[i];
 
 	/* build decode LUT */
 	for(i = 0; i < HUFFMAN_LUTSIZE; i++)
 	{
 		unsigned Bits = i;
+		unsigned Node = hf->m_StartNode;
 		int k;
-		HuffmanNode *pNode = hf->m_pStartNode;
-		for(k = 0; k < HUFFMAN_LUTBITS; k++)
+		for(k = 0; k < HUFFMAN_LUTBITS && Node >= HUFFMAN_MAX_SYMBOLS; k++)
 		{
-			pNode = &hf->m_aNodes[pNode->m_aLeafs[Bits&1]];
+			Node = hf->m_aaLeafs[Node-HUFFMAN_MAX_SYMBOLS][Bits&1];
 			Bits >>= 1;
+		}
+
+		/* the symbol and its length, or the node to go on from */
+		if(Node < HUFFMAN_MAX_SYMBOLS)
+			hf->m_aDecodeLut[i] = (unsigned short)(Node | (hf->m_aCodeLengths[Node]<<HUFFMAN_PACKED_NUMBITSSHIFT));
+		else
+			hf->m_aDecodeLut[i] = (unsigned short)(Node | HUFFMAN_PACKED_NODE);
+	}
+
+	/* symbols of the longest code in the tree that fit into one refill of HuffmanDecompress.
+	   it's taken from the tree, not from the encoder's tables */
+	Depth = HuffmanSubtreeDepth(hf, hf->m_StartNode);
+	hf->m_DecodeBatch = Depth <= HUFFMAN_FAST_MAXBITS ? (unsigned)(HUFFMAN_ACCBITS-8)/Depth : 0;
+
+	/* build multi-symbol tables */
+	HuffmanBuildMultiLut(hf);
+
+	/* build encode table */
+	HuffmanBuildEncodeLut(hf);
+}
+
+static void HuffmanBuildEncodeLut(Huffman *hf)
+{
+	int i;
+
+	hf->m_FastEncode = 1;
+	for(i = 0; i < HUFFMAN_MAX_SYMBOLS; i++)
+	{
+		/* longer codes don't fit, the compressor will use the codes directly */
+		if(hf->m_aCodeLengths[i] > HUFFMAN_FAST_MAXBITS)
+			hf->m_FastEncode = 0;
+		hf->m_aEncodeLut[i] = (hf->m_aCodeBits[i]&0xffffff) | ((unsigned)hf->m_aCodeLengths[i]<<HUFFMAN_ENCODE_NUMBITSSHIFT);
+	}
+}
+
+static unsigned HuffmanSubtreeDepth(const Huffman *hf, unsigned Node)
+{
+	unsigned Depth0, Depth1;
+
+	if(Node < HUFFMAN_MAX_SYMBOLS)
+		return 0;
 
-			if(!pNode)
+	Depth0 = HuffmanSubtreeDepth(hf, hf->m_aaLeafs[Node-HUFFMAN_MAX_SYMBOLS][0]);
+	Depth1 = HuffmanSubtreeDepth(hf, hf->m_aaLeafs[Node-HUFFMAN_MAX_SYMBOLS][1]);
+	return 1 + (Depth0 > Depth1 ? Depth0 : Depth1);
+}
+
+static void HuffmanBuildMultiLut(Huffman *hf)
+{
+	unsigned NumSub = 0;
+	unsigned MaxBits = 0;
+	unsigned i, j;
+
+	hf->m_FastTables = 0;
+
+	/* the fast decoder needs every code to fit into one refill */
+	for(i = 0; i < HUFFMAN_MAX_SYMBOLS; i++)
+		if(hf->m_aCodeLengths[i] > MaxBits)
+			MaxBits = hf->m_aCodeLengths[i];
+	if(MaxBits > HUFFMAN_FAST_MAXBITS)
+		return;
+
+	for(i = 0; i < HUFFMAN_MULTISIZE; i++)
+	{
+		unsigned Entry = 0;
+		unsigned NumSyms = 0;
+		unsigned Used = 0;
+		unsigned Pos = 0;
+		unsigned Node = hf->m_StartNode;
+
+		/* collect as many whole symbols as the index bits hold */
+		while(NumSyms < HUFFMAN_MULTIMAXSYMS && Pos < HUFFMAN_MULTIBITS)
+		{
+			Node = hf->m_aaLeafs[Node-HUFFMAN_MAX_SYMBOLS][(i>>Pos)&1];
+			Pos++;
+
+			if(Node >= HUFFMAN_MAX_SYMBOLS)
+				continue;
+
+			/* eof always goes through the sub table */
+			if(Node == HUFFMAN_EOF_SYMBOL)
 				break;
 
-			if(pNode->m_NumBits)
+			Entry |= Node << (NumSyms*8);
+			NumSyms++;
+			Used = Pos;
+			Node = hf->m_StartNode;
+		}
+
+		if(NumSyms)
+		{
+			hf->m_aMultiLut[i] = Entry | (NumSyms<<HUFFMAN_ENTRY_COUNTSHIFT) | (Used<<HUFFMAN_ENTRY_BITSSHIFT);
+			continue;
+		}
+
+		/* the first code is eof or longer than the index, resolve the rest with a sub table */
+		{
+			unsigned SubBits = HuffmanSubtreeDepth(hf, Node);
+			unsigned Prefix = Pos;
+			unsigned PrefixNode = Node;
+
+			if(NumSub + (1u<<SubBits) > HUFFMAN_SUBLUTSIZE)
+				return;
+
+			hf->m_aMultiLut[i] = NumSub | (SubBits<<HUFFMAN_ENTRY_SUBBITSSHIFT);
+			for(j = 0; j < (1u<<SubBits); j++)
 			{
-				hf->m_apDecodeLut[i] = pNode;
-				break;
+				unsigned Len = Prefix;
+				Node = PrefixNode;
+				while(Node >= HUFFMAN_MAX_SYMBOLS)
+				{
+					Node = hf->m_aaLeafs[Node-HUFFMAN_MAX_SYMBOLS][(j>>(Len-Prefix))&1];
+					Len++;
+				}
+
+				if(Node == HUFFMAN_EOF_SYMBOL)
+					hf->m_aSubLut[NumSub+j] = Len<<HUFFMAN_ENTRY_BITSSHIFT;
+				else
+					hf->m_aSubLut[NumSub+j] = Node | (1<<HUFFMAN_ENTRY_COUNTSHIFT) | (Len<<HUFFMAN_ENTRY_BITSSHIFT);
 			}
+			NumSub += 1u<<SubBits;
 		}
+	}
 
-		if(k == HUFFMAN_LUTBITS)
-			hf->m_apDecodeLut[i] = pNode;
+	hf->m_FastTables = 1;
+}
+
+/* load a whole accumulator, lowest bits first */
+static HUFFMAN_INLINE unsigned long HuffmanLoadBits(const unsigned char *pSrc)
+{
+	unsigned long Bits;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	memcpy(&Bits, pSrc, sizeof(Bits));
+#else
+	unsigned i;
+	Bits = 0;
+	for(i = 0; i < sizeof(Bits); i++)
+		Bits |= (unsigned long)pSrc[i] << (i*8);
+#endif
+	return Bits;
+}
+
+/* store the whole accumulator, lowest bits first */
+static void HuffmanStoreBits(unsigned char *pDst, unsigned long Bits)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	memcpy(pDst, &Bits, sizeof(Bits));
+#else
+	unsigned i;
+	for(i = 0; i < sizeof(Bits); i++)
+		pDst[i] = (unsigned char)(Bits >> (i*8));
+#endif
+}
+
+/* the fast encode loop for Batch codes per store, it's called with a constant so each batch size
+   gets a loop of its own. after a store less than a byte is left, so Batch codes of up to
+   (HUFFMAN_ACCBITS-8)/Batch bits always fit before the next one */
+static HUFFMAN_INLINE void HuffmanEncodeBatches(const Huffman *hf, const unsigned char **ppSrc, const unsigned char *pSrcEnd,
+	unsigned char **ppDst, unsigned char *pDstEnd, unsigned long *pBits, unsigned *pBitcount, unsigned Batch)
+{
+	const unsigned char *pSrc = *ppSrc;
+	unsigned char *pDst = *ppDst;
+	unsigned long Bits = *pBits;
+	unsigned Bitcount = *pBitcount;
+	unsigned Code, i;
+
+	while(pSrcEnd - pSrc >= (long)Batch && pDstEnd - pDst >= (long)sizeof(Bits))
+	{
+		/* two codes are joined first, so only every other one waits for Bitcount */
+		for(i = 0; i+1 < Batch; i += 2)
+		{
+			unsigned Code0 = hf->m_aEncodeLut[pSrc[i]];
+			unsigned Code1 = hf->m_aEncodeLut[pSrc[i+1]];
+			unsigned Length0 = Code0>>HUFFMAN_ENCODE_NUMBITSSHIFT;
+			unsigned long Pair = (Code0&0xffffff) | ((unsigned long)(Code1&0xffffff) << Length0);
+			Bits |= Pair << Bitcount;
+			Bitcount += Length0 + (Code1>>HUFFMAN_ENCODE_NUMBITSSHIFT);
+		}
+		if(i < Batch)
+		{
+			Code = hf->m_aEncodeLut[pSrc[i]];
+			Bits |= (unsigned long)(Code&0xffffff) << Bitcount;
+			Bitcount += Code>>HUFFMAN_ENCODE_NUMBITSSHIFT;
+		}
+		pSrc += Batch;
+
+		HuffmanStoreBits(pDst, Bits);
+		pDst += Bitcount>>3;
+		Bits >>= Bitcount&~7u;
+		Bitcount &= 7;
 	}
+
+	*ppSrc = pSrc;
+	*ppDst = pDst;
+	*pBits = Bits;
+	*pBitcount = Bitcount;
 }
 
-int HuffmanDecompress(Huffman *hf, const void *pInput, int InputSize, void *pOutput, int OutputSize)
+int HuffmanCompress(const Huffman *hf, const void *pInput, int InputSize, void *pOutput, int OutputSize)
 {
 	/* setup buffer pointers */
+	const unsigned char *pSrc = (const unsigned char *)pInput;
+	const unsigned char *pSrcEnd = pSrc + InputSize;
 	unsigned char *pDst = (unsigned char *)pOutput;
-	unsigned char *pSrc = (unsigned char *)pInput;
 	unsigned char *pDstEnd = pDst + OutputSize;
-	unsigned char *pSrcEnd = pSrc + InputSize;
 
-	unsigned Bits = 0;
+	unsigned long Bits = 0;
 	unsigned Bitcount = 0;
+	unsigned Length;
 
-	HuffmanNode *pEof = &hf->m_aNodes[HUFFMAN_EOF_SYMBOL];
-	HuffmanNode *pNode = 0;
+	/* {A} fast loop, in batches of as many codes as always fit next to a partial byte */
+	if(hf->m_FastEncode)
+	{
+		switch((HUFFMAN_ACCBITS-8)/hf->m_MaxCodeLength)
+		{
+		default: HuffmanEncodeBatches(hf, &pSrc, pSrcEnd, &pDst, pDstEnd, &Bits, &Bitcount, 6); break;
+		case 5: HuffmanEncodeBatches(hf, &pSrc, pSrcEnd, &pDst, pDstEnd, &Bits, &Bitcount, 5); break;
+		case 4: HuffmanEncodeBatches(hf, &pSrc, pSrcEnd, &pDst, pDstEnd, &Bits, &Bitcount, 4); break;
+		case 3: HuffmanEncodeBatches(hf, &pSrc, pSrcEnd, &pDst, pDstEnd, &Bits, &Bitcount, 3); break;
+		case 2: HuffmanEncodeBatches(hf, &pSrc, pSrcEnd, &pDst, pDstEnd, &Bits, &Bitcount, 2); break;
+		case 1: break;
+		}
+		/* the rest of a batch, a code at a time */
+		HuffmanEncodeBatches(hf, &pSrc, pSrcEnd, &pDst, pDstEnd, &Bits, &Bitcount, 1);
+	}
 
+	/* {B} finish the input and eof one byte at a time */
 	while(1)
 	{
-		/* {A} try to load a node now, this will reduce dependency at location {D} */
-		pNode = 0;
-		if(Bitcount >= HUFFMAN_LUTBITS)
-			pNode = hf->m_apDecodeLut[Bits&HUFFMAN_LUTMASK];
+		unsigned Symbol = pSrc != pSrcEnd ? *pSrc : HUFFMAN_EOF_SYMBOL;
 
-		/* {B} fill with new bits */
-		while(Bitcount < 24 && pSrc != pSrcEnd)
+		/* write out what we have so far */
+		while(Bitcount >= 8)
 		{
-			Bits |= (*pSrc++) << Bitcount;
-			Bitcount += 8;
+			if(pDst == pDstEnd)
+				return -1;
+			*pDst++ = (unsigned char)Bits;
+			Bits >>= 8;
+			Bitcount -= 8;
 		}
 
-		/* {C} load symbol now if we didn't that earlier at location {A} */
-		if(!pNode)
-			pNode = hf->m_apDecodeLut[Bits&HUFFMAN_LUTMASK];
+		/* the decoders refill only up to 24 bits near the end of the input and longer codes
+		   from degenerate frequencies also lose their high bits, they wouldn't come back the same */
+		Length = hf->m_aCodeLengths[Symbol];
+		if(Length > HUFFMAN_FAST_MAXBITS)
+			return -1;
+
+		Bits |= (unsigned long)hf->m_aCodeBits[Symbol] << Bitcount;
+		Bitcount += Length;
+
+		if(pSrc == pSrcEnd)
+			break;
+		pSrc++;
+	}
 
-		if(!pNode)
+	/* {C} write out the remaining bits and the last byte, teeworlds always emits it even when it's empty */
+	while(Bitcount >= 8)
+	{
+		if(pDst == pDstEnd)
 			return -1;
+		*pDst++ = (unsigned char)Bits;
+		Bits >>= 8;
+		Bitcount -= 8;
+	}
+	if(pDst == pDstEnd)
+		return -1;
+	*pDst++ = (unsigned char)Bits;
+
+	/* return the size of the output */
+	return (int)(pDst - (const unsigned char *)pOutput);
+}
+
+int HuffmanDecompress(const Huffman *hf, const void *pInput, int InputSize, void *pOutput, int OutputSize)
+{
+	/* setup buffer pointers */
+	unsigned char *pDst = (unsigned char *)pOutput;
+	const unsigned char *pSrc = (const unsigned char *)pInput;
+
+	if(!hf->m_DecodeBatch)
+		return HuffmanDecompressLong(hf, pSrc, pSrc + InputSize, 0, 0, pDst, pDst, pDst + OutputSize);
+	return HuffmanDecompressFrom(hf, pSrc, pSrc + InputSize, 0, 0, pDst, pDst, pDst + OutputSize);
+}
+
+/* the fast loop of HuffmanDecompressFrom for Batch symbols per refill, it's called with a constant
+   so each batch size gets a loop of its own. returns 1 when it decoded eof */
+static HUFFMAN_INLINE int HuffmanDecodeBatches(const Huffman *hf, const unsigned char **ppSrc, const unsigned char *pSrcEnd,
+	unsigned long *pBits, unsigned *pBitcount, unsigned char **ppDst, unsigned char *pDstEnd, unsigned Batch)
+{
+	const unsigned char *pSrc = *ppSrc;
+	unsigned char *pDst = *ppDst;
+	unsigned long Bits = *pBits;
+	unsigned Bitcount = *pBitcount;
+	unsigned Entry, Symbol, i;
+	int Eof = 0;
+
+	while(!Eof && pSrcEnd - pSrc >= (long)sizeof(Bits) && pDstEnd - pDst >= (long)Batch)
+	{
+		Bits |= HuffmanLoadBits(pSrc) << Bitcount;
+		pSrc += (HUFFMAN_ACCBITS-1-Bitcount)>>3;
+		Bitcount |= HUFFMAN_ACCBITS-8;
+
+		for(i = 0; i < Batch; i++)
+		{
+			Entry = hf->m_aDecodeLut[Bits&HUFFMAN_LUTMASK];
+			Symbol = Entry&HUFFMAN_PACKED_SYMBOLMASK;
+			if(!(Entry&HUFFMAN_PACKED_NODE))
+			{
+				Bits >>= Entry>>HUFFMAN_PACKED_NUMBITSSHIFT;
+				Bitcount -= Entry>>HUFFMAN_PACKED_NUMBITSSHIFT;
+			}
+			else
+			{
+				Bits >>= HUFFMAN_LUTBITS;
+				Bitcount -= HUFFMAN_LUTBITS;
+				do
+				{
+					Symbol = hf->m_aaLeafs[Symbol-HUFFMAN_MAX_SYMBOLS][Bits&1];
+					Bitcount--;
+					Bits >>= 1;
+				}
+				while(Symbol >= HUFFMAN_MAX_SYMBOLS);
+			}
+
+			if(Symbol == HUFFMAN_EOF_SYMBOL)
+			{
+				Eof = 1;
+				break;
+			}
+			*pDst++ = (unsigned char)Symbol;
+		}
+	}
+
+	*ppSrc = pSrc;
+	*ppDst = pDst;
+	*pBits = Bits;
+	*pBitcount = Bitcount;
+	return Eof;
+}
+
+/* {B} careful loop for the rest of HuffmanDecompressFrom, every symbol checks the bits and the output left.
+   like in teeworlds missing bits read as zeros, only a tree walk that uses up the last bit without a symbol
+   fails. teeworlds only refills up to 24 bits and fails longer codes where it runs out, so tables with codes
+   over HUFFMAN_FAST_MAXBITS are decoded without WordRefill, with exactly the bits it would have */
+static HUFFMAN_INLINE int HuffmanDecodeRest(const Huffman *hf, const unsigned char *pSrc, const unsigned char *pSrcEnd, unsigned long Bits, unsigned Bitcount,
+	unsigned char *pOutput, unsigned char *pDst, unsigned char *pDstEnd, int WordRefill)
+{
+	unsigned Entry;
+	unsigned Symbol;
+
+	while(1)
+	{
+		/* {B.1} fill with new bits, a whole word at once while there is enough input left */
+		if(WordRefill && pSrcEnd - pSrc >= (long)sizeof(Bits))
+		{
+			if(Bitcount <= HUFFMAN_ACCBITS-8)
+			{
+				Bits |= HuffmanLoadBits(pSrc) << Bitcount;
+				pSrc += (HUFFMAN_ACCBITS-1-Bitcount)>>3;
+				Bitcount |= HUFFMAN_ACCBITS-8;
+			}
+		}
+		else
+		{
+			while(Bitcount < 24 && pSrc != pSrcEnd)
+			{
+				Bits |= (unsigned long)(*pSrc++) << Bitcount;
+				Bitcount += 8;
+			}
+		}
 
-		/* {D} check if we hit a symbol already */
-		if(pNode->m_NumBits)
+		/* {B.2} load the symbol */
+		Entry = hf->m_aDecodeLut[Bits&HUFFMAN_LUTMASK];
+
+		/* {B.3} check if we hit a symbol already */
+		if(!(Entry&HUFFMAN_PACKED_NODE))
 		{
 			/* remove the bits for that symbol */
-			Bits >>= pNode->m_NumBits;
-			Bitcount -= pNode->m_NumBits;
+			Symbol = Entry&HUFFMAN_PACKED_SYMBOLMASK;
+			Bits >>= Entry>>HUFFMAN_PACKED_NUMBITSSHIFT;
+			Bitcount -= Entry>>HUFFMAN_PACKED_NUMBITSSHIFT;
 		}
 		else
 		{
 			/* remove the bits that the lut checked up for us */
+			Symbol = Entry&HUFFMAN_PACKED_SYMBOLMASK;
 			Bits >>= HUFFMAN_LUTBITS;
 			Bitcount -= HUFFMAN_LUTBITS;
 
@@ -177,14 +555,14 @@ int HuffmanDecompress(Huffman *hf, const void *pInput, int InputSize, void *pOut
 			while(1)
 			{
 				/* traverse tree */
-				pNode = &hf->m_aNodes[pNode->m_aLeafs[Bits&1]];
+				Symbol = hf->m_aaLeafs[Symbol-HUFFMAN_MAX_SYMBOLS][Bits&1];
 
 				/* remove bit */
 				Bitcount--;
 				Bits >>= 1;
 
 				/* check if we hit a symbol */
-				if(pNode->m_NumBits)
+				if(Symbol < HUFFMAN_MAX_SYMBOLS)
 					break;
 
 				/* no more bits, decoding error */
@@ -194,15 +572,622 @@ int HuffmanDecompress(Huffman *hf, const void *pInput, int InputSize, void *pOut
 		}
 
 		/* check for eof */
-		if(pNode == pEof)
+		if(Symbol == HUFFMAN_EOF_SYMBOL)
 			break;
 
 		/* output character */
 		if(pDst == pDstEnd)
 			return -1;
-		*pDst++ = pNode->m_Symbol;
+		*pDst++ = (unsigned char)Symbol;
 	}
 
 	/* return the size of the decompressed buffer */
-	return (int)(pDst - (const unsigned char *)pOutput);
+	return (int)(pDst - pOutput);
+}
+
+/* HuffmanDecompressFrom for trees deeper than HUFFMAN_FAST_MAXBITS, kept out of the common path */
+static int HuffmanDecompressLong(const Huffman *hf, const unsigned char *pSrc, const unsigned char *pSrcEnd, unsigned long Bits, unsigned Bitcount,
+	unsigned char *pOutput, unsigned char *pDst, unsigned char *pDstEnd)
+{
+	return HuffmanDecodeRest(hf, pSrc, pSrcEnd, Bits, Bitcount, pOutput, pDst, pDstEnd, 0);
+}
+
+/* the reference decoding loop, starting from an already filled bit buffer.
+   trees deeper than HUFFMAN_FAST_MAXBITS go to HuffmanDecompressLong instead */
+static int HuffmanDecompressFrom(const Huffman *hf, const unsigned char *pSrc, const unsigned char *pSrcEnd, unsigned long Bits, unsigned Bitcount,
+	unsigned char *pOutput, unsigned char *pDst, unsigned char *pDstEnd)
+{
+	int Result = 0;
+
+	/* {A} fast loop: after a whole refill there are enough bits for m_DecodeBatch codes, so as
+	   long as there's room for that many symbols neither the bits nor the output need checks */
+	switch(hf->m_DecodeBatch)
+	{
+	case 0: break;
+	case 1: Result = HuffmanDecodeBatches(hf, &pSrc, pSrcEnd, &Bits, &Bitcount, &pDst, pDstEnd, 1); break;
+	case 2: Result = HuffmanDecodeBatches(hf, &pSrc, pSrcEnd, &Bits, &Bitcount, &pDst, pDstEnd, 2); break;
+	case 3: Result = HuffmanDecodeBatches(hf, &pSrc, pSrcEnd, &Bits, &Bitcount, &pDst, pDstEnd, 3); break;
+	case 4: Result = HuffmanDecodeBatches(hf, &pSrc, pSrcEnd, &Bits, &Bitcount, &pDst, pDstEnd, 4); break;
+	case 5: Result = HuffmanDecodeBatches(hf, &pSrc, pSrcEnd, &Bits, &Bitcount, &pDst, pDstEnd, 5); break;
+	default: Result = HuffmanDecodeBatches(hf, &pSrc, pSrcEnd, &Bits, &Bitcount, &pDst, pDstEnd, 6); break;
+	}
+	if(Result)
+		return (int)(pDst - pOutput);
+
+	/* {B} the rest, see HuffmanDecodeRest */
+	return HuffmanDecodeRest(hf, pSrc, pSrcEnd, Bits, Bitcount, pOutput, pDst, pDstEnd, 1);
+}
+
+static void HuffmanFastStart(HuffmanFastLane *pLane, const void *pInput, int InputSize, void *pOutput, int OutputSize)
+{
+	pLane->m_pSrc = (const unsigned char *)pInput;
+	pLane->m_pSrcEnd = pLane->m_pSrc + InputSize;
+	pLane->m_pOutput = (unsigned char *)pOutput;
+	pLane->m_pDst = pLane->m_pOutput;
+	pLane->m_pDstEnd = pLane->m_pDst + OutputSize;
+	pLane->m_Bits = 0;
+	pLane->m_Bitcount = 0;
+}
+
+/* as long as a whole refill is available and every entry can be stored, no bounds checks are needed */
+static HUFFMAN_INLINE int HuffmanFastReady(const HuffmanFastLane *pLane)
+{
+	return pLane->m_pSrcEnd - pLane->m_pSrc >= (long)sizeof(pLane->m_Bits) && pLane->m_pDstEnd - pLane->m_pDst >= HUFFMAN_MULTIMAXSYMS;
+}
+
+/* decodes one table entry, returns 0 when it was eof */
+static HUFFMAN_INLINE int HuffmanFastStep(const Huffman *hf, HuffmanFastLane *pLane)
+{
+	unsigned long Bits = pLane->m_Bits;
+	unsigned Bitcount = pLane->m_Bitcount;
+	unsigned Entry;
+
+	/* fill the accumulator up to its last whole byte */
+	Bits |= HuffmanLoadBits(pLane->m_pSrc) << Bitcount;
+	pLane->m_pSrc += (HUFFMAN_ACCBITS-1-Bitcount)>>3;
+	Bitcount |= HUFFMAN_ACCBITS-8;
+
+	/* look at the sub table unconditionally, it's cheaper than a branch on long codes */
+	Entry = hf->m_aMultiLut[Bits&HUFFMAN_MULTIMASK];
+	{
+		unsigned Escape = !((Entry>>HUFFMAN_ENTRY_COUNTSHIFT)&3);
+		unsigned SubMask = (1u<<((Entry>>HUFFMAN_ENTRY_SUBBITSSHIFT)&0xf))-1;
+		unsigned SubEntry = hf->m_aSubLut[Escape ? (Entry&0xffff) + ((unsigned)(Bits>>HUFFMAN_MULTIBITS)&SubMask) : 0];
+		Entry = Escape ? SubEntry : Entry;
+	}
+
+	if(!((Entry>>HUFFMAN_ENTRY_COUNTSHIFT)&3))
+	{
+		/* keep the state, so stepping again gives eof again */
+		pLane->m_Bits = Bits;
+		pLane->m_Bitcount = Bitcount;
+		return 0;
+	}
+
+	/* store all slots, only the decoded ones are kept */
+	pLane->m_pDst[0] = (unsigned char)Entry;
+	pLane->m_pDst[1] = (unsigned char)(Entry>>8);
+	pLane->m_pDst[2] = (unsigned char)(Entry>>16);
+	pLane->m_pDst += (Entry>>HUFFMAN_ENTRY_COUNTSHIFT)&3;
+
+	pLane->m_Bits = Bits >> ((Entry>>HUFFMAN_ENTRY_BITSSHIFT)&31);
+	pLane->m_Bitcount = Bitcount - ((Entry>>HUFFMAN_ENTRY_BITSSHIFT)&31);
+	return 1;
+}
+
+/* same as HuffmanFastStep near the end of the buffers, returns -1 when the
+   next entry needs more bits than are left or doesn't fit into the output */
+static HUFFMAN_INLINE int HuffmanFastStepTail(const Huffman *hf, HuffmanFastLane *pLane)
+{
+	unsigned long Bits = pLane->m_Bits;
+	unsigned Bitcount = pLane->m_Bitcount;
+	const unsigned char *pSrc = pLane->m_pSrc;
+	unsigned Entry, NumBits, Count, i;
+
+	while(Bitcount <= HUFFMAN_ACCBITS-8 && pSrc != pLane->m_pSrcEnd)
+	{
+		Bits |= (unsigned long)(*pSrc++) << Bitcount;
+		Bitcount += 8;
+	}
+	pLane->m_pSrc = pSrc;
+	pLane->m_Bits = Bits;
+	pLane->m_Bitcount = Bitcount;
+
+	Entry = hf->m_aMultiLut[Bits&HUFFMAN_MULTIMASK];
+	if(!((Entry>>HUFFMAN_ENTRY_COUNTSHIFT)&3))
+	{
+		unsigned SubMask = (1u<<((Entry>>HUFFMAN_ENTRY_SUBBITSSHIFT)&0xf))-1;
+		Entry = hf->m_aSubLut[(Entry&0xffff) + ((unsigned)(Bits>>HUFFMAN_MULTIBITS)&SubMask)];
+	}
+
+	/* the missing bits would be zeros here, leave that to the reference loop */
+	NumBits = (Entry>>HUFFMAN_ENTRY_BITSSHIFT)&31;
+	if(NumBits > Bitcount)
+		return -1;
+
+	Count = (Entry>>HUFFMAN_ENTRY_COUNTSHIFT)&3;
+	if(!Count)
+		return 0;
+	if(pLane->m_pDstEnd - pLane->m_pDst < (long)Count)
+		return -1;
+
+	for(i = 0; i < Count; i++)
+		pLane->m_pDst[i] = (unsigned char)(Entry>>(i*8));
+	pLane->m_pDst += Count;
+
+	pLane->m_Bits = Bits >> NumBits;
+	pLane->m_Bitcount = Bitcount - NumBits;
+	return 1;
+}
+
+/* gives back the whole bytes we didn't use and finishes with the reference loop */
+static int HuffmanFastFinish(const Huffman *hf, HuffmanFastLane *pLane)
+{
+	unsigned Bitcount = pLane->m_Bitcount&7;
+	unsigned Bits = (unsigned)(pLane->m_Bits & ((1ul<<Bitcount)-1));
+
+	return HuffmanDecompressFrom(hf, pLane->m_pSrc - (pLane->m_Bitcount>>3), pLane->m_pSrcEnd, Bits, Bitcount,
+		pLane->m_pOutput, pLane->m_pDst, pLane->m_pDstEnd);
+}
+
+int HuffmanDecompressFast(const Huffman *hf, const void *pInput, int InputSize, void *pOutput, int OutputSize)
+{
+	HuffmanFastLane Lane;
+	int Result;
+
+	if(!hf->m_FastTables)
+		return HuffmanDecompress(hf, pInput, InputSize, pOutput, OutputSize);
+
+	HuffmanFastStart(&Lane, pInput, InputSize, pOutput, OutputSize);
+	while(HuffmanFastReady(&Lane))
+	{
+		if(!HuffmanFastStep(hf, &Lane))
+			return (int)(Lane.m_pDst - Lane.m_pOutput);
+	}
+
+	while((Result = HuffmanFastStepTail(hf, &Lane)) > 0)
+		;
+	if(Result == 0)
+		return (int)(Lane.m_pDst - Lane.m_pOutput);
+
+	return HuffmanFastFinish(hf, &Lane);
+}
+
+/* puts the next packet into a lane, returns 0 when there are none left. packets too short to
+   keep a lane busy for a few refills are decoded right away, interleaving them is slower */
+static int HuffmanBatchNext(const Huffman *hf, HuffmanFastLane *pLane, HuffmanPacket *pPackets, int NumPackets, int *pNext, int *pLanePacket, int *pNumFailed)
+{
+	HuffmanPacket *pPacket;
+
+	while(*pNext != NumPackets && pPackets[*pNext].m_InputSize < HUFFMAN_BATCH_MININPUT)
+	{
+		pPacket = &pPackets[(*pNext)++];
+		pPacket->m_Result = HuffmanDecompressFast(hf, pPacket->m_pInput, pPacket->m_InputSize, pPacket->m_pOutput, pPacket->m_OutputSize);
+		if(pPacket->m_Result < 0)
+			(*pNumFailed)++;
+	}
+	if(*pNext == NumPackets)
+		return 0;
+
+	*pLanePacket = (*pNext)++;
+	HuffmanFastStart(pLane, pPackets[*pLanePacket].m_pInput, pPackets[*pLanePacket].m_InputSize,
+		pPackets[*pLanePacket].m_pOutput, pPackets[*pLanePacket].m_OutputSize);
+	return 1;
+}
+
+int HuffmanDecompressBatch(const Huffman *hf, HuffmanPacket *pPackets, int NumPackets)
+{
+	HuffmanFastLane aLanes[HUFFMAN_BATCH_LANES];
+	int aLanePacket[HUFFMAN_BATCH_LANES];
+	int aActive[HUFFMAN_BATCH_LANES];
+	int NumActive = 0;
+	int NumFailed = 0;
+	int Next = 0;
+	int i;
+
+	if(!hf->m_FastTables)
+	{
+		for(i = 0; i < NumPackets; i++)
+		{
+			pPackets[i].m_Result = HuffmanDecompress(hf, pPackets[i].m_pInput, pPackets[i].m_InputSize, pPackets[i].m_pOutput, pPackets[i].m_OutputSize);
+			if(pPackets[i].m_Result < 0)
+				NumFailed++;
+		}
+		return NumFailed;
+	}
+
+	for(i = 0; i < HUFFMAN_BATCH_LANES; i++)
+	{
+		aActive[i] = HuffmanBatchNext(hf, &aLanes[i], pPackets, NumPackets, &Next, &aLanePacket[i], &NumFailed);
+		NumActive += aActive[i];
+	}
+
+	/* step every lane once per round, so the independent streams overlap */
+	while(NumActive)
+	{
+		/* while all lanes are busy and have headroom, step them without any other checks */
+		while(NumActive == HUFFMAN_BATCH_LANES)
+		{
+			int Running = 1;
+
+			for(i = 0; i < HUFFMAN_BATCH_LANES; i++)
+				Running &= HuffmanFastReady(&aLanes[i]);
+			if(!Running)
+				break;
+
+			for(i = 0; i < HUFFMAN_BATCH_LANES; i++)
+				Running &= HuffmanFastStep(hf, &aLanes[i]);
+			if(!Running)
+				break;
+		}
+
+		for(i = 0; i < HUFFMAN_BATCH_LANES; i++)
+		{
+			int Result;
+
+			if(!aActive[i])
+				continue;
+
+			if(HuffmanFastReady(&aLanes[i]))
+			{
+				Result = HuffmanFastStep(hf, &aLanes[i]);
+				if(Result > 0)
+					continue;
+			}
+			else
+			{
+				/* the tail is short, finish it right away */
+				while((Result = HuffmanFastStepTail(hf, &aLanes[i])) > 0)
+					;
+			}
+			if(Result == 0)
+				Result = (int)(aLanes[i].m_pDst - aLanes[i].m_pOutput);
+			else
+				Result = HuffmanFastFinish(hf, &aLanes[i]);
+
+			/* packet done, hand the lane to the next one */
+			pPackets[aLanePacket[i]].m_Result = Result;
+			if(Result < 0)
+				NumFailed++;
+
+			if(!HuffmanBatchNext(hf, &aLanes[i], pPackets, NumPackets, &Next, &aLanePacket[i], &NumFailed))
+			{
+				aActive[i] = 0;
+				NumActive--;
+			}
+		}
+	}
+
+	return NumFailed;
+}
+
+void HuffmanStreamInit(HuffmanStream *pStream, const Huffman *hf, void *pRing, int RingSize)
+{
+	pStream->m_pHuffman = hf;
+	pStream->m_Bits = 0;
+	pStream->m_Bitcount = 0;
+	pStream->m_Node = hf->m_StartNode;
+	pStream->m_pRing = (unsigned char *)pRing;
+	pStream->m_RingSize = RingSize;
+	pStream->m_RingStart = 0;
+	pStream->m_RingUsed = 0;
+	pStream->m_Total = 0;
+	pStream->m_Eof = 0;
+}
+
+int HuffmanStreamFeed(HuffmanStream *pStream, const void *pInput, int InputSize)
+{
+	const Huffman *hf = pStream->m_pHuffman;
+	const unsigned char *pSrc = (const unsigned char *)pInput;
+	const unsigned char *pSrcEnd = pSrc + InputSize;
+	unsigned Node = pStream->m_Node;
+	unsigned Bits = pStream->m_Bits;
+	unsigned Bitcount = pStream->m_Bitcount;
+	int RingWrite = pStream->m_RingStart + pStream->m_RingUsed;
+
+	if(RingWrite >= pStream->m_RingSize)
+		RingWrite -= pStream->m_RingSize;
+
+	while(!pStream->m_Eof && pStream->m_RingUsed < pStream->m_RingSize)
+	{
+		/* fill with new bits */
+		while(Bitcount < 24 && pSrc != pSrcEnd)
+		{
+			Bits |= (*pSrc++) << Bitcount;
+			Bitcount += 8;
+		}
+
+		/* at the start of a symbol the lut can resolve the first bits at once */
+		if(Node == hf->m_StartNode && Bitcount >= HUFFMAN_LUTBITS)
+		{
+			unsigned Entry = hf->m_aDecodeLut[Bits&HUFFMAN_LUTMASK];
+			unsigned NumBits = Entry&HUFFMAN_PACKED_NODE ? HUFFMAN_LUTBITS : Entry>>HUFFMAN_PACKED_NUMBITSSHIFT;
+
+			Node = Entry&HUFFMAN_PACKED_SYMBOLMASK;
+			Bits >>= NumBits;
+			Bitcount -= NumBits;
+		}
+
+		/* walk the tree with what is left, the position is kept when the bits run out */
+		while(Node >= HUFFMAN_MAX_SYMBOLS && Bitcount)
+		{
+			Node = hf->m_aaLeafs[Node-HUFFMAN_MAX_SYMBOLS][Bits&1];
+			Bitcount--;
+			Bits >>= 1;
+		}
+
+		if(Node >= HUFFMAN_MAX_SYMBOLS)
+			break;
+
+		if(Node == HUFFMAN_EOF_SYMBOL)
+			pStream->m_Eof = 1;
+		else
+		{
+			pStream->m_pRing[RingWrite] = (unsigned char)Node;
+			if(++RingWrite == pStream->m_RingSize)
+				RingWrite = 0;
+			pStream->m_RingUsed++;
+			pStream->m_Total++;
+		}
+		Node = hf->m_StartNode;
+	}
+
+	/* give back the whole bytes we didn't use, as less than a byte is kept
+	   between calls they were all part of this chunk */
+	pSrc -= Bitcount>>3;
+	Bitcount &= 7;
+	Bits &= (1u<<Bitcount)-1;
+
+	/* after eof the rest of the byte is padding */
+	if(pStream->m_Eof)
+	{
+		Bits = 0;
+		Bitcount = 0;
+	}
+
+	pStream->m_Node = Node;
+	pStream->m_Bits = Bits;
+	pStream->m_Bitcount = Bitcount;
+	return (int)(pSrc - (const unsigned char *)pInput);
+}
+
+int HuffmanStreamRead(HuffmanStream *pStream, void *pOutput, int OutputSize)
+{
+	unsigned char *pDst = (unsigned char *)pOutput;
+	int Size = OutputSize < pStream->m_RingUsed ? OutputSize : pStream->m_RingUsed;
+	int First = pStream->m_RingSize - pStream->m_RingStart;
+
+	if(Size <= 0)
+		return 0;
+
+	/* the data can wrap around the end of the ring */
+	if(First > Size)
+		First = Size;
+	memcpy(pDst, pStream->m_pRing + pStream->m_RingStart, First);
+	memcpy(pDst + First, pStream->m_pRing, Size - First);
+
+	pStream->m_RingStart += Size;
+	if(pStream->m_RingStart >= pStream->m_RingSize)
+		pStream->m_RingStart -= pStream->m_RingSize;
+	pStream->m_RingUsed -= Size;
+	return Size;
+}
+
+int HuffmanStreamFinish(const HuffmanStream *pStream)
+{
+	return pStream->m_Eof ? pStream->m_Total : -1;
+}
+
+static unsigned HuffmanReadU32(const unsigned char *pSrc)
+{
+	return pSrc[0] | (pSrc[1]<<8) | ((unsigned)pSrc[2]<<16) | ((unsigned)pSrc[3]<<24);
+}
+
+static void HuffmanWriteU32(unsigned char *pDst, unsigned Value)
+{
+	pDst[0] = (unsigned char)Value;
+	pDst[1] = (unsigned char)(Value>>8);
+	pDst[2] = (unsigned char)(Value>>16);
+	pDst[3] = (unsigned char)(Value>>24);
+}
+
+int HuffmanChunkedCompress(const Huffman *hf, const void *pInput, int InputSize, int BlockSize, void *pOutput, int OutputSize)
+{
+	const unsigned char *pSrc = (const unsigned char *)pInput;
+	unsigned char *pDst = (unsigned char *)pOutput;
+	unsigned char *pData;
+	int NumBlocks, DataCapacity, DataSize = 0;
+	int Block;
+
+	if(InputSize < 0 || BlockSize <= 0)
+		return -1;
+
+	/* the header and the index come first, the blocks follow */
+	NumBlocks = InputSize/BlockSize + (InputSize%BlockSize != 0);
+	if(OutputSize < HUFFMAN_CHUNKED_HEADERSIZE || (OutputSize-HUFFMAN_CHUNKED_HEADERSIZE)/HUFFMAN_CHUNKED_ENTRYSIZE <= NumBlocks)
+		return -1;
+	pData = pDst + HUFFMAN_CHUNKED_HEADERSIZE + (NumBlocks+1)*HUFFMAN_CHUNKED_ENTRYSIZE;
+	DataCapacity = OutputSize - (int)(pData - pDst);
+
+	memcpy(pDst, "HFC1", 4);
+	HuffmanWriteU32(pDst + 4, (unsigned)BlockSize);
+	HuffmanWriteU32(pDst + 8, (unsigned)NumBlocks);
+	HuffmanWriteU32(pDst + 12, (unsigned)InputSize);
+
+	for(Block = 0; Block <= NumBlocks; Block++)
+	{
+		unsigned char *pEntry = pDst + HUFFMAN_CHUNKED_HEADERSIZE + Block*HUFFMAN_CHUNKED_ENTRYSIZE;
+		int Offset = Block < NumBlocks ? Block*BlockSize : InputSize;
+		int Size;
+
+		HuffmanWriteU32(pEntry, (unsigned)DataSize);
+		HuffmanWriteU32(pEntry + 4, (unsigned)Offset);
+		if(Block == NumBlocks)
+			break;
+
+		Size = HuffmanCompress(hf, pSrc + Offset, InputSize - Offset < BlockSize ? InputSize - Offset : BlockSize,
+			pData + DataSize, DataCapacity - DataSize);
+		if(Size < 0)
+			return -1;
+		DataSize += Size;
+	}
+
+	return (int)(pData - pDst) + DataSize;
+}
+
+int HuffmanChunkedOpen(HuffmanChunked *pChunked, const void *pData, int Size)
+{
+	const unsigned char *pSrc = (const unsigned char *)pData;
+	unsigned BlockSize, NumBlocks, TotalSize;
+	unsigned Block, MaxBlock = 0;
+
+	if(Size < HUFFMAN_CHUNKED_HEADERSIZE || memcmp(pSrc, "HFC1", 4) != 0)
+		return -1;
+
+	BlockSize = HuffmanReadU32(pSrc + 4);
+	NumBlocks = HuffmanReadU32(pSrc + 8);
+	TotalSize = HuffmanReadU32(pSrc + 12);
+	if(BlockSize == 0 || BlockSize > INT_MAX || TotalSize > INT_MAX ||
+		NumBlocks >= (unsigned)(Size-HUFFMAN_CHUNKED_HEADERSIZE)/HUFFMAN_CHUNKED_ENTRYSIZE)
+		return -1;
+
+	pChunked->m_pIndex = pSrc + HUFFMAN_CHUNKED_HEADERSIZE;
+	pChunked->m_pData = pChunked->m_pIndex + (NumBlocks+1)*HUFFMAN_CHUNKED_ENTRYSIZE;
+	pChunked->m_DataSize = Size - (int)(pChunked->m_pData - pSrc);
+	pChunked->m_NumBlocks = (int)NumBlocks;
+	pChunked->m_Size = (int)TotalSize;
+
+	/* validate the index once, so decoding doesn't have to. every block has at least the eof byte */
+	if(HuffmanReadU32(pChunked->m_pIndex) != 0 || HuffmanReadU32(pChunked->m_pIndex + 4) != 0)
+		return -1;
+	for(Block = 0; Block < NumBlocks; Block++)
+	{
+		const unsigned char *pEntry = pChunked->m_pIndex + Block*HUFFMAN_CHUNKED_ENTRYSIZE;
+		unsigned Packed = HuffmanReadU32(pEntry + HUFFMAN_CHUNKED_ENTRYSIZE) - HuffmanReadU32(pEntry);
+		unsigned Unpacked = HuffmanReadU32(pEntry + HUFFMAN_CHUNKED_ENTRYSIZE + 4) - HuffmanReadU32(pEntry + 4);
+
+		if(HuffmanReadU32(pEntry + HUFFMAN_CHUNKED_ENTRYSIZE) <= HuffmanReadU32(pEntry) ||
+			HuffmanReadU32(pEntry + HUFFMAN_CHUNKED_ENTRYSIZE + 4) <= HuffmanReadU32(pEntry + 4) ||
+			Packed > (unsigned)pChunked->m_DataSize || Unpacked > BlockSize)
+			return -1;
+		if(Unpacked > MaxBlock)
+			MaxBlock = Unpacked;
+	}
+	if(HuffmanReadU32(pChunked->m_pIndex + NumBlocks*HUFFMAN_CHUNKED_ENTRYSIZE) != (unsigned)pChunked->m_DataSize ||
+		HuffmanReadU32(pChunked->m_pIndex + NumBlocks*HUFFMAN_CHUNKED_ENTRYSIZE + 4) != TotalSize)
+		return -1;
+
+	pChunked->m_BlockSize = (int)MaxBlock;
+	return 0;
+}
+
+int HuffmanChunkedBlockOffset(const HuffmanChunked *pChunked, int Block)
+{
+	return (int)HuffmanReadU32(pChunked->m_pIndex + Block*HUFFMAN_CHUNKED_ENTRYSIZE + 4);
+}
+
+int HuffmanChunkedBlockAt(const HuffmanChunked *pChunked, int Offset)
+{
+	int Lo = 0, Hi = pChunked->m_NumBlocks-1;
+
+	if(Offset < 0 || Offset >= pChunked->m_Size)
+		return -1;
+
+	/* the last block that starts at or before the offset */
+	while(Lo < Hi)
+	{
+		int Mid = Lo + (Hi-Lo+1)/2;
+		if(HuffmanChunkedBlockOffset(pChunked, Mid) <= Offset)
+			Lo = Mid;
+		else
+			Hi = Mid-1;
+	}
+	return Lo;
+}
+
+int HuffmanChunkedDecompressBlocks(const Huffman *hf, const HuffmanChunked *pChunked, int First, int NumBlocks, void *pOutput)
+{
+	HuffmanPacket aPackets[HUFFMAN_BATCH_LANES*4];
+	unsigned char *pDst = (unsigned char *)pOutput;
+	int Start, Block, i;
+
+	if(First < 0 || NumBlocks < 0 || First > pChunked->m_NumBlocks - NumBlocks)
+		return -1;
+
+	/* feed the blocks to the batch decoder, a few lanes worth at a time */
+	Start = HuffmanChunkedBlockOffset(pChunked, First);
+	for(Block = First; Block < First+NumBlocks; Block += i)
+	{
+		int NumPackets = First+NumBlocks-Block < (int)(sizeof(aPackets)/sizeof(aPackets[0])) ? First+NumBlocks-Block : (int)(sizeof(aPackets)/sizeof(aPackets[0]));
+
+		for(i = 0; i < NumPackets; i++)
+		{
+			const unsigned char *pEntry = pChunked->m_pIndex + (Block+i)*HUFFMAN_CHUNKED_ENTRYSIZE;
+			int Offset = (int)HuffmanReadU32(pEntry + 4);
+
+			aPackets[i].m_pInput = pChunked->m_pData + HuffmanReadU32(pEntry);
+			aPackets[i].m_InputSize = (int)(HuffmanReadU32(pEntry + HUFFMAN_CHUNKED_ENTRYSIZE) - HuffmanReadU32(pEntry));
+			aPackets[i].m_pOutput = pDst + (Offset - Start);
+			aPackets[i].m_OutputSize = (int)HuffmanReadU32(pEntry + HUFFMAN_CHUNKED_ENTRYSIZE + 4) - Offset;
+		}
+
+		/* a block that decodes to less than the index says is broken as well */
+		if(HuffmanDecompressBatch(hf, aPackets, NumPackets) != 0)
+			return -1;
+		for(i = 0; i < NumPackets; i++)
+			if(aPackets[i].m_Result != aPackets[i].m_OutputSize)
+				return -1;
+	}
+
+	return HuffmanChunkedBlockOffset(pChunked, First+NumBlocks) - Start;
+}
+
+int HuffmanChunkedDecompress(const Huffman *hf, const HuffmanChunked *pChunked, void *pOutput, int OutputSize)
+{
+	if(OutputSize < pChunked->m_Size)
+		return -1;
+	return HuffmanChunkedDecompressBlocks(hf, pChunked, 0, pChunked->m_NumBlocks, pOutput);
+}
+
+int HuffmanChunkedRead(const Huffman *hf, const HuffmanChunked *pChunked, int Offset, void *pOutput, int Size, void *pScratch)
+{
+	unsigned char *pDst = (unsigned char *)pOutput;
+	int First, Last, End;
+
+	if(Offset < 0 || Size < 0 || Offset > pChunked->m_Size)
+		return -1;
+	if(Size > pChunked->m_Size - Offset)
+		Size = pChunked->m_Size - Offset;
+	if(Size == 0)
+		return 0;
+
+	/* whole blocks go straight to the output, the partial ones at the edges through the scratch buffer */
+	End = Offset + Size;
+	First = HuffmanChunkedBlockAt(pChunked, Offset);
+	Last = HuffmanChunkedBlockAt(pChunked, End-1);
+
+	if(HuffmanChunkedBlockOffset(pChunked, First) != Offset || HuffmanChunkedBlockOffset(pChunked, First+1) > End)
+	{
+		int BlockStart = HuffmanChunkedBlockOffset(pChunked, First);
+		int BlockEnd = HuffmanChunkedBlockOffset(pChunked, First+1);
+
+		if(HuffmanChunkedDecompressBlocks(hf, pChunked, First, 1, pScratch) < 0)
+			return -1;
+		memcpy(pDst, (const unsigned char *)pScratch + (Offset - BlockStart), (BlockEnd < End ? BlockEnd : End) - Offset);
+		First++;
+	}
+	if(Last >= First && HuffmanChunkedBlockOffset(pChunked, Last+1) != End)
+	{
+		int BlockStart = HuffmanChunkedBlockOffset(pChunked, Last);
+
+		if(HuffmanChunkedDecompressBlocks(hf, pChunked, Last, 1, pScratch) < 0)
+			return -1;
+		memcpy(pDst + (BlockStart - Offset), pScratch, End - BlockStart);
+		Last--;
+	}
+	if(Last >= First && HuffmanChunkedDecompressBlocks(hf, pChunked, First, Last-First+1,
+		pDst + (HuffmanChunkedBlockOffset(pChunked, First) - Offset)) < 0)
+		return -1;
+
+	return Size;
 }
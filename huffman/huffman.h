@@ -7,39 +7,155 @@ enum
 
 	HUFFMAN_LUTBITS = 10,
 	HUFFMAN_LUTSIZE = (1<<HUFFMAN_LUTBITS),
-	HUFFMAN_LUTMASK = (HUFFMAN_LUTSIZE-1)
+	HUFFMAN_LUTMASK = (HUFFMAN_LUTSIZE-1),
+
+	/* layout of a packed decode lut entry */
+	HUFFMAN_PACKED_SYMBOLMASK = 0x3ff,
+	HUFFMAN_PACKED_NUMBITSSHIFT = 10,
+	HUFFMAN_PACKED_NODE = 0x8000,
+
+	/* multi-symbol decode table, see HuffmanDecompressFast */
+	HUFFMAN_MULTIBITS = 11,
+	HUFFMAN_MULTISIZE = (1<<HUFFMAN_MULTIBITS),
+	HUFFMAN_MULTIMASK = (HUFFMAN_MULTISIZE-1),
+	HUFFMAN_MULTIMAXSYMS = 3,
+	HUFFMAN_SUBLUTSIZE = 512,
+	HUFFMAN_FAST_MAXBITS = 24,
+	HUFFMAN_BATCH_LANES = 4,
+
+	/* layout of a packed multi-symbol entry */
+	HUFFMAN_ENTRY_COUNTSHIFT = 24,
+	HUFFMAN_ENTRY_BITSSHIFT = 26,
+	HUFFMAN_ENTRY_SUBBITSSHIFT = 16,
+	HUFFMAN_ENCODE_NUMBITSSHIFT = 24,
+
+	/* chunked container: the header, then one index entry per block and one for the end */
+	HUFFMAN_CHUNKED_HEADERSIZE = 16,
+	HUFFMAN_CHUNKED_ENTRYSIZE = 8
 };
 
-typedef struct
-{
-	/* symbol */
+/* the tables are only written by HuffmanInit, everything else takes them const and keeps its
+   state on the stack or in a HuffmanStream. one Huffman (or HuffmanPrecomputed) can be
+   shared by any number of threads once it's built */
+typedef struct {
+	/* the tree without pointers. nodes below HUFFMAN_MAX_SYMBOLS are the leaves and their index
+	   is the symbol, only the internal nodes after them are stored here, with their two children */
+	unsigned short m_aaLeafs[HUFFMAN_MAX_NODES-HUFFMAN_MAX_SYMBOLS][2];
+
+	/* decode lut, 16 bit entries: the symbol in bits 0-9 and its length in bits 10-14,
+	   or the node to continue from when bit 15 is set */
+	unsigned short m_aDecodeLut[HUFFMAN_LUTSIZE];
+	unsigned short m_StartNode;
+	/* symbols the fast loop of HuffmanDecompress takes from one refill, as many as codes of the
+	   deepest leaf fit. 0 turns the loop off, when that's longer than HUFFMAN_FAST_MAXBITS */
+	unsigned m_DecodeBatch;
+
+	/* code of every symbol, the decoder doesn't touch these */
+	unsigned m_aCodeBits[HUFFMAN_MAX_SYMBOLS];
+	unsigned short m_aCodeLengths[HUFFMAN_MAX_SYMBOLS];
+	/* the longest of them, the fast loops size their batches from it */
+	unsigned m_MaxCodeLength;
+
+	/* multi-symbol tables. an entry holds up to HUFFMAN_MULTIMAXSYMS symbols in
+	   bits 0-23, their count in bits 24-25 and the bits they use in bits 26-30.
+	   a count of 0 escapes to m_aSubLut (base in bits 0-15, index width in bits 16-19),
+	   whose entries hold a single symbol, or the eof symbol when their count is 0 */
+	unsigned m_aMultiLut[HUFFMAN_MULTISIZE];
+	unsigned m_aSubLut[HUFFMAN_SUBLUTSIZE];
+	int m_FastTables;
+
+	/* encode table, code bits in bits 0-23 and their count in bits 24-31 */
+	unsigned m_aEncodeLut[HUFFMAN_MAX_SYMBOLS];
+	int m_FastEncode;
+} Huffman;
+
+/* one packet for HuffmanDecompressBatch */
+typedef struct {
+	const void *m_pInput;
+	int m_InputSize;
+	void *m_pOutput;
+	int m_OutputSize;
+
+	/* set to the decompressed size, or -1 on error */
+	int m_Result;
+} HuffmanPacket;
+
+/* incremental decoder state, see HuffmanStreamInit */
+typedef struct {
+	const Huffman *m_pHuffman;
+
+	/* bits not decoded yet and the tree position of a partially read symbol */
 	unsigned m_Bits;
-	unsigned m_NumBits;
+	unsigned m_Bitcount;
+	unsigned m_Node;
 
-	/* don't use pointers for this. shorts are smaller so we can fit more data into the cache */
-	unsigned short m_aLeafs[2];
+	/* decoded output waiting for HuffmanStreamRead */
+	unsigned char *m_pRing;
+	int m_RingSize;
+	int m_RingStart;
+	int m_RingUsed;
 
-	/* what the symbol represents */
-	unsigned char m_Symbol;
-} HuffmanNode;
+	int m_Total;
+	int m_Eof;
+} HuffmanStream;
 
+/* an opened chunked container, see HuffmanChunkedOpen. it points into the caller's data */
 typedef struct {
-	HuffmanNode m_aNodes[HUFFMAN_MAX_NODES];
-	HuffmanNode *m_apDecodeLut[HUFFMAN_LUTSIZE];
-	HuffmanNode *m_pStartNode;
-	int m_NumNodes;
-} Huffman;
+	const unsigned char *m_pIndex;
+	const unsigned char *m_pData;
+	int m_DataSize;
+	int m_NumBlocks;
+	/* uncompressed size of the largest block, and of the whole payload */
+	int m_BlockSize;
+	int m_Size;
+} HuffmanChunked;
 
 typedef struct {
 	unsigned short m_NodeId;
  	int m_Frequency;
 } HuffmanConstructNode;
 
-void HuffmanSetbits_r(Huffman *hf, HuffmanNode *pNode, int Bits, unsigned Depth);
-void HuffmanConstructTree(Huffman *hf);
-void HuffmanInit(Huffman *hf);
-int HuffmanDecompress(Huffman *hf, const void *pInput, int InputSize, void *pOutput, int OutputSize);
+void HuffmanSetbits_r(Huffman *hf, int Node, unsigned Bits, unsigned Depth);
+void HuffmanConstructTree(Huffman *hf, const unsigned *pFrequencies);
+/* pFrequencies holds one frequency per byte value (eof is always 1), NULL uses HuffmanFreqTable */
+void HuffmanInit(Huffman *hf, const unsigned *pFrequencies);
+int HuffmanCompress(const Huffman *hf, const void *pInput, int InputSize, void *pOutput, int OutputSize);
+int HuffmanDecompress(const Huffman *hf, const void *pInput, int InputSize, void *pOutput, int OutputSize);
+int HuffmanDecompressFast(const Huffman *hf, const void *pInput, int InputSize, void *pOutput, int OutputSize);
+/* streaming decoder: feed the input in chunks as it arrives, the output is kept in the
+   caller's ring buffer until it is read. Feed returns the number of input bytes it used,
+   it stops early when the ring is full (feed the rest again after reading) or when eof
+   was decoded (the rest doesn't belong to this stream) */
+void HuffmanStreamInit(HuffmanStream *pStream, const Huffman *hf, void *pRing, int RingSize);
+int HuffmanStreamFeed(HuffmanStream *pStream, const void *pInput, int InputSize);
+int HuffmanStreamRead(HuffmanStream *pStream, void *pOutput, int OutputSize);
+/* returns the decompressed size once eof was decoded, -1 while it's missing */
+int HuffmanStreamFinish(const HuffmanStream *pStream);
+/* decodes HUFFMAN_BATCH_LANES packets at a time, returns the number of packets that failed */
+int HuffmanDecompressBatch(const Huffman *hf, HuffmanPacket *pPackets, int NumPackets);
+/* chunked container: the input is coded in independent blocks of BlockSize bytes, with an index of
+   their compressed and uncompressed offsets. blocks can be decoded in any order and from any thread,
+   so a thread pool can split the blocks between its workers, and a reader can start anywhere.
+   the format is "HFC1", then the block size, the number of blocks and the uncompressed size, then
+   a compressed and an uncompressed offset per block and for the end, all 32 bit little endian */
+int HuffmanChunkedCompress(const Huffman *hf, const void *pInput, int InputSize, int BlockSize, void *pOutput, int OutputSize);
+/* checks the header and the whole index, returns -1 when they are broken */
+int HuffmanChunkedOpen(HuffmanChunked *pChunked, const void *pData, int Size);
+/* uncompressed offset of a block, Block == m_NumBlocks gives the uncompressed size */
+int HuffmanChunkedBlockOffset(const HuffmanChunked *pChunked, int Block);
+/* the block holding an uncompressed offset, -1 when it's past the end */
+int HuffmanChunkedBlockAt(const HuffmanChunked *pChunked, int Offset);
+/* decodes NumBlocks blocks from First on to pOutput, which has to hold all of them. returns their size or -1 */
+int HuffmanChunkedDecompressBlocks(const Huffman *hf, const HuffmanChunked *pChunked, int First, int NumBlocks, void *pOutput);
+int HuffmanChunkedDecompress(const Huffman *hf, const HuffmanChunked *pChunked, void *pOutput, int OutputSize);
+/* reads Size bytes from an uncompressed offset, pScratch has to hold m_BlockSize bytes for the partial blocks
+   at the edges. returns the number of bytes read (less at the end of the payload) or -1 */
+int HuffmanChunkedRead(const Huffman *hf, const HuffmanChunked *pChunked, int Offset, void *pOutput, int Size, void *pScratch);
 
+#ifdef HUFFMAN_PRECOMPUTED
+/* the tables for HuffmanFreqTable, generated by tools/gentables.c into huffman_tables.c */
+extern const Huffman HuffmanPrecomputed;
+#endif
 
 static const unsigned HuffmanFreqTable[256+1] = {
 	1<<30,4545,2657,431,1950,919,444,482,2244,617,838,542,715,1814,304,240,754,212,647,186,
@@ -0,0 +1,337 @@
+/* throughput benchmark for the encoder and the decoders, prints one csv line per run.
+   the corpora are drawn from HuffmanFreqTable (and plain random bytes as the worst case),
+   cold runs switch to a table that hasn't been touched for a while before every call */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../huffman.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BENCH_CYCLES() __builtin_ia32_rdtsc()
+#endif
+
+enum
+{
+	/* raw bytes per corpus, split into packets of the size under test */
+	BENCH_POOLSIZE = 1<<20,
+	/* packets handled per timed call, HuffmanDecompressBatch gets all of them at once */
+	BENCH_UNIT = 16,
+	/* enough copies of the tables to push the ones not in use out of the caches */
+	BENCH_COLDTABLES = 1024,
+	/* ring of the streaming decoder, about what one socket read gives */
+	BENCH_RINGSIZE = 4096
+};
+
+typedef struct
+{
+	const char *m_pName;
+	int m_Size;
+	int m_NumPackets;
+	unsigned char *m_pRaw;
+	unsigned char *m_pPacked;
+	int *m_pPackedSize;
+	unsigned char *m_pOutput;
+	HuffmanPacket *m_pPackets;
+} BenchCorpus;
+
+typedef int (*BENCHFUNC)(const Huffman *hf, BenchCorpus *pCorpus, int First);
+
+static unsigned g_Seed = 1;
+
+static unsigned BenchRand(void)
+{
+	g_Seed = g_Seed*1103515245u + 12345u;
+	return (g_Seed>>8)&0xffffff;
+}
+
+static int BenchPackedCapacity(int Size)
+{
+	/* codes of random bytes can be longer than a byte, give it some room */
+	return Size*2+16;
+}
+
+/* the bytes with their frequency in HuffmanFreqTable. byte 0 is set to 1<<30 there to give it a
+   one bit code, it's weighted as much as all others together instead so the other codes show up */
+static void BenchFillFreq(unsigned char *pData, int Size)
+{
+	unsigned long aCumulative[256];
+	unsigned long Total = 0;
+	int i;
+
+	for(i = 1; i < 256; i++)
+		Total += HuffmanFreqTable[i];
+	aCumulative[0] = Total;
+	Total *= 2;
+	for(i = 1; i < 256; i++)
+		aCumulative[i] = aCumulative[i-1] + HuffmanFreqTable[i];
+
+	for(i = 0; i < Size; i++)
+	{
+		unsigned long r = (unsigned long)BenchRand() % Total;
+		int Lo = 0, Hi = 255;
+		while(Lo < Hi)
+		{
+			int Mid = (Lo+Hi)/2;
+			if(r < aCumulative[Mid])
+				Hi = Mid;
+			else
+				Lo = Mid+1;
+		}
+		pData[i] = (unsigned char)Lo;
+	}
+}
+
+static void BenchFillRandom(unsigned char *pData, int Size)
+{
+	int i;
+	for(i = 0; i < Size; i++)
+		pData[i] = (unsigned char)BenchRand();
+}
+
+static int BenchCorpusInit(BenchCorpus *pCorpus, const Huffman *hf, const char *pName, int Size)
+{
+	int Capacity = BenchPackedCapacity(Size);
+	int i;
+
+	pCorpus->m_pName = pName;
+	pCorpus->m_Size = Size;
+	pCorpus->m_NumPackets = BENCH_POOLSIZE/Size;
+	if(pCorpus->m_NumPackets < BENCH_UNIT)
+		pCorpus->m_NumPackets = BENCH_UNIT;
+	pCorpus->m_NumPackets -= pCorpus->m_NumPackets%BENCH_UNIT;
+
+	pCorpus->m_pRaw = (unsigned char *)malloc((size_t)pCorpus->m_NumPackets*Size);
+	pCorpus->m_pPacked = (unsigned char *)malloc((size_t)pCorpus->m_NumPackets*Capacity);
+	pCorpus->m_pPackedSize = (int *)malloc(pCorpus->m_NumPackets*sizeof(int));
+	pCorpus->m_pOutput = (unsigned char *)malloc((size_t)pCorpus->m_NumPackets*Size);
+	pCorpus->m_pPackets = (HuffmanPacket *)malloc(pCorpus->m_NumPackets*sizeof(HuffmanPacket));
+	if(!pCorpus->m_pRaw || !pCorpus->m_pPacked || !pCorpus->m_pPackedSize || !pCorpus->m_pOutput || !pCorpus->m_pPackets)
+		return -1;
+
+	if(strcmp(pName, "random") == 0)
+		BenchFillRandom(pCorpus->m_pRaw, pCorpus->m_NumPackets*Size);
+	else
+		BenchFillFreq(pCorpus->m_pRaw, pCorpus->m_NumPackets*Size);
+
+	for(i = 0; i < pCorpus->m_NumPackets; i++)
+	{
+		HuffmanPacket *pPacket = &pCorpus->m_pPackets[i];
+
+		pCorpus->m_pPackedSize[i] = HuffmanCompress(hf, pCorpus->m_pRaw + (size_t)i*Size, Size,
+			pCorpus->m_pPacked + (size_t)i*Capacity, Capacity);
+		if(pCorpus->m_pPackedSize[i] < 0)
+			return -1;
+
+		pPacket->m_pInput = pCorpus->m_pPacked + (size_t)i*Capacity;
+		pPacket->m_InputSize = pCorpus->m_pPackedSize[i];
+		pPacket->m_pOutput = pCorpus->m_pOutput + (size_t)i*Size;
+		pPacket->m_OutputSize = Size;
+	}
+	return 0;
+}
+
+static void BenchCorpusFree(BenchCorpus *pCorpus)
+{
+	free(pCorpus->m_pRaw);
+	free(pCorpus->m_pPacked);
+	free(pCorpus->m_pPackedSize);
+	free(pCorpus->m_pOutput);
+	free(pCorpus->m_pPackets);
+}
+
+/* the operations, each handles BENCH_UNIT packets starting at First and returns the number that failed */
+static int BenchEncode(const Huffman *hf, BenchCorpus *pCorpus, int First)
+{
+	int Capacity = BenchPackedCapacity(pCorpus->m_Size);
+	int Failed = 0;
+	int i;
+
+	for(i = First; i < First+BENCH_UNIT; i++)
+		Failed += HuffmanCompress(hf, pCorpus->m_pRaw + (size_t)i*pCorpus->m_Size, pCorpus->m_Size,
+			pCorpus->m_pPacked + (size_t)i*Capacity, Capacity) != pCorpus->m_pPackedSize[i];
+	return Failed;
+}
+
+static int BenchDecode(const Huffman *hf, BenchCorpus *pCorpus, int First)
+{
+	int Failed = 0;
+	int i;
+
+	for(i = First; i < First+BENCH_UNIT; i++)
+	{
+		HuffmanPacket *pPacket = &pCorpus->m_pPackets[i];
+		Failed += HuffmanDecompress(hf, pPacket->m_pInput, pPacket->m_InputSize, pPacket->m_pOutput, pPacket->m_OutputSize) != pCorpus->m_Size;
+	}
+	return Failed;
+}
+
+static int BenchDecodeFast(const Huffman *hf, BenchCorpus *pCorpus, int First)
+{
+	int Failed = 0;
+	int i;
+
+	for(i = First; i < First+BENCH_UNIT; i++)
+	{
+		HuffmanPacket *pPacket = &pCorpus->m_pPackets[i];
+		Failed += HuffmanDecompressFast(hf, pPacket->m_pInput, pPacket->m_InputSize, pPacket->m_pOutput, pPacket->m_OutputSize) != pCorpus->m_Size;
+	}
+	return Failed;
+}
+
+static int BenchDecodeBatch(const Huffman *hf, BenchCorpus *pCorpus, int First)
+{
+	return HuffmanDecompressBatch(hf, &pCorpus->m_pPackets[First], BENCH_UNIT);
+}
+
+static int BenchDecodeStream(const Huffman *hf, BenchCorpus *pCorpus, int First)
+{
+	unsigned char aRing[BENCH_RINGSIZE];
+	HuffmanStream Stream;
+	int Failed = 0;
+	int i;
+
+	for(i = First; i < First+BENCH_UNIT; i++)
+	{
+		HuffmanPacket *pPacket = &pCorpus->m_pPackets[i];
+		const unsigned char *pInput = (const unsigned char *)pPacket->m_pInput;
+		unsigned char *pOutput = (unsigned char *)pPacket->m_pOutput;
+		int Fed = 0, Read = 0;
+
+		HuffmanStreamInit(&Stream, hf, aRing, sizeof(aRing));
+		while(1)
+		{
+			int NumFed = HuffmanStreamFeed(&Stream, pInput + Fed, pPacket->m_InputSize - Fed);
+			int NumRead = HuffmanStreamRead(&Stream, pOutput + Read, pPacket->m_OutputSize - Read);
+			if(!NumFed && !NumRead)
+				break;
+			Fed += NumFed;
+			Read += NumRead;
+		}
+		Failed += HuffmanStreamFinish(&Stream) != pCorpus->m_Size || Read != pCorpus->m_Size;
+	}
+	return Failed;
+}
+
+/* runs Func for at least MinSeconds, cold runs use a different table copy for every call */
+static int BenchRun(BENCHFUNC Func, const char *pOp, BenchCorpus *pCorpus, const Huffman *pTables, int NumTables, double MinSeconds)
+{
+	/* look at the clock about once per pool worth of data, it's too slow to call every time */
+	int CallsPerCheck = pCorpus->m_NumPackets/BENCH_UNIT;
+	long Calls = 0;
+	int Failed = 0;
+	int Packet = 0;
+	int Table = 0;
+	double Seconds, Bytes;
+	clock_t Start, Now;
+#ifdef BENCH_CYCLES
+	double StartCycles, Cycles;
+#endif
+
+	/* warm up, and make sure the outputs are right before timing anything */
+	memset(pCorpus->m_pOutput, 0, (size_t)pCorpus->m_NumPackets*pCorpus->m_Size);
+	for(Packet = 0; Packet < pCorpus->m_NumPackets; Packet += BENCH_UNIT)
+		Failed += Func(&pTables[0], pCorpus, Packet);
+	if(Failed || (Func != BenchEncode && memcmp(pCorpus->m_pOutput, pCorpus->m_pRaw, (size_t)pCorpus->m_NumPackets*pCorpus->m_Size) != 0))
+	{
+		fprintf(stderr, "%s on %s/%d gives wrong results\n", pOp, pCorpus->m_pName, pCorpus->m_Size);
+		return -1;
+	}
+
+	Packet = 0;
+	Start = clock();
+#ifdef BENCH_CYCLES
+	StartCycles = (double)BENCH_CYCLES();
+#endif
+	do
+	{
+		int i;
+		for(i = 0; i < CallsPerCheck; i++)
+		{
+			Func(&pTables[Table], pCorpus, Packet);
+			Packet += BENCH_UNIT;
+			if(Packet == pCorpus->m_NumPackets)
+				Packet = 0;
+			if(++Table == NumTables)
+				Table = 0;
+		}
+		Calls += CallsPerCheck;
+		Now = clock();
+	}
+	while((double)(Now-Start)/CLOCKS_PER_SEC < MinSeconds);
+#ifdef BENCH_CYCLES
+	Cycles = (double)BENCH_CYCLES() - StartCycles;
+#endif
+
+	Seconds = (double)(Now-Start)/CLOCKS_PER_SEC;
+	Bytes = (double)Calls*BENCH_UNIT*pCorpus->m_Size;
+	/* every packet also decodes the eof symbol */
+	printf("%s,%s,%s,%d,%.0f,%.6f,%.2f,%.0f,", pOp, NumTables > 1 ? "cold" : "warm", pCorpus->m_pName, pCorpus->m_Size,
+		Bytes, Seconds, Bytes/Seconds/1e6, (double)Calls*BENCH_UNIT*(pCorpus->m_Size+1)/Seconds);
+#ifdef BENCH_CYCLES
+	printf("%.3f\n", Cycles/Bytes);
+#else
+	printf("-1\n");
+#endif
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	static const int s_aSizes[] = {16, 64, 256, 1024, 4096, 16384, 65536};
+	static const char *s_apCorpora[] = {"freq", "random"};
+	static const struct { const char *m_pName; BENCHFUNC m_Func; } s_aOps[] = {
+		{"encode", BenchEncode},
+		{"decode", BenchDecode},
+		{"decode_fast", BenchDecodeFast},
+		{"decode_batch", BenchDecodeBatch},
+		{"decode_stream", BenchDecodeStream}
+	};
+	double MinSeconds = argc > 1 ? atof(argv[1]) : 0.1;
+	Huffman *pTables;
+	int Failed = 0;
+	unsigned c, s, o;
+	int i;
+
+	if(MinSeconds <= 0)
+	{
+		fprintf(stderr, "usage: %s [seconds per run]\n", argv[0]);
+		return 1;
+	}
+
+	/* the tables hold no pointers, so the cold copies are plain copies */
+	pTables = (Huffman *)malloc(BENCH_COLDTABLES*sizeof(Huffman));
+	if(!pTables)
+		return 1;
+	HuffmanInit(&pTables[0], NULL);
+	for(i = 1; i < BENCH_COLDTABLES; i++)
+		memcpy(&pTables[i], &pTables[0], sizeof(Huffman));
+
+	printf("op,tables,corpus,packet_size,bytes,seconds,mb_per_s,symbols_per_s,cycles_per_byte\n");
+	for(c = 0; c < sizeof(s_apCorpora)/sizeof(s_apCorpora[0]); c++)
+	{
+		for(s = 0; s < sizeof(s_aSizes)/sizeof(s_aSizes[0]); s++)
+		{
+			BenchCorpus Corpus;
+
+			g_Seed = 1;
+			if(BenchCorpusInit(&Corpus, &pTables[0], s_apCorpora[c], s_aSizes[s]) != 0)
+			{
+				fprintf(stderr, "can't set up %s/%d\n", s_apCorpora[c], s_aSizes[s]);
+				return 1;
+			}
+
+			for(o = 0; o < sizeof(s_aOps)/sizeof(s_aOps[0]); o++)
+			{
+				Failed |= BenchRun(s_aOps[o].m_Func, s_aOps[o].m_pName, &Corpus, pTables, 1, MinSeconds);
+				Failed |= BenchRun(s_aOps[o].m_Func, s_aOps[o].m_pName, &Corpus, pTables, BENCH_COLDTABLES, MinSeconds);
+			}
+			fflush(stdout);
+
+			BenchCorpusFree(&Corpus);
+		}
+	}
+
+	free(pTables);
+	return Failed ? 1 : 0;
+}
@@ -0,0 +1,294 @@
+/* fuzz harness, checks every decoder against a copy of the teeworlds decoding loop and
+   round trips the input through the encoder and the container. any difference aborts.
+   besides the default table it runs with a text-like one and one with codes longer than
+   HUFFMAN_FAST_MAXBITS, which only the tree walks can decode.
+   libFuzzer: clang -g -O1 -fsanitize=fuzzer,address -DHUFFMAN_FUZZ_LIBFUZZER tools/fuzz.c huffman.c
+   AFL: afl-clang-fast -g -O1 tools/fuzz.c huffman.c, it reads the input from stdin or the given files */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../huffman.h"
+
+enum
+{
+	FUZZ_MAXINPUT = 1<<16,
+	FUZZ_MAXOUTPUT = 1<<17,
+	/* HuffmanCompress only takes codes of up to HUFFMAN_FAST_MAXBITS */
+	FUZZ_MAXPACKED = FUZZ_MAXINPUT*3+16,
+	/* one byte blocks take an index entry and up to seven bytes each */
+	FUZZ_MAXCONTAINER = FUZZ_MAXINPUT*(HUFFMAN_CHUNKED_ENTRYSIZE+7)+HUFFMAN_CHUNKED_HEADERSIZE+HUFFMAN_CHUNKED_ENTRYSIZE,
+	/* copies of a packet for HuffmanDecompressBatch, so all lanes get used */
+	FUZZ_BATCH = HUFFMAN_BATCH_LANES+1,
+	/* the default table, a text-like one and one with codes up to 31 bits */
+	FUZZ_TABLES = 3
+};
+
+static Huffman s_aHuffman[FUZZ_TABLES];
+static int s_Initialized = 0;
+
+static unsigned char s_aReference[FUZZ_MAXOUTPUT];
+static unsigned char s_aOutput[FUZZ_MAXOUTPUT];
+static unsigned char s_aaBatch[FUZZ_BATCH][FUZZ_MAXOUTPUT];
+static unsigned char s_aPacked[FUZZ_MAXPACKED];
+static unsigned char s_aContainer[FUZZ_MAXCONTAINER];
+
+/* the decoding loop of teeworlds' CHuffman::Decompress, one bit at a time below the lut */
+static int FuzzReference(const Huffman *hf, const unsigned char *pSrc, int InputSize, unsigned char *pDst, int OutputSize)
+{
+	const unsigned char *pSrcEnd = pSrc + InputSize;
+	unsigned char *pDstStart = pDst;
+	unsigned char *pDstEnd = pDst + OutputSize;
+	unsigned Bits = 0;
+	unsigned Bitcount = 0;
+
+	while(1)
+	{
+		unsigned Entry, Node;
+
+		while(Bitcount < 24 && pSrc != pSrcEnd)
+		{
+			Bits |= (unsigned)(*pSrc++) << Bitcount;
+			Bitcount += 8;
+		}
+
+		Entry = hf->m_aDecodeLut[Bits&HUFFMAN_LUTMASK];
+		Node = Entry&HUFFMAN_PACKED_SYMBOLMASK;
+		if(!(Entry&HUFFMAN_PACKED_NODE))
+		{
+			Bits >>= Entry>>HUFFMAN_PACKED_NUMBITSSHIFT;
+			Bitcount -= Entry>>HUFFMAN_PACKED_NUMBITSSHIFT;
+		}
+		else
+		{
+			Bits >>= HUFFMAN_LUTBITS;
+			Bitcount -= HUFFMAN_LUTBITS;
+			while(1)
+			{
+				Node = hf->m_aaLeafs[Node-HUFFMAN_MAX_SYMBOLS][Bits&1];
+				Bitcount--;
+				Bits >>= 1;
+				if(Node < HUFFMAN_MAX_SYMBOLS)
+					break;
+				if(Bitcount == 0)
+					return -1;
+			}
+		}
+
+		if(Node == HUFFMAN_EOF_SYMBOL)
+			break;
+		if(pDst == pDstEnd)
+			return -1;
+		*pDst++ = (unsigned char)Node;
+	}
+
+	return (int)(pDst - pDstStart);
+}
+
+static void FuzzCheck(const char *pWhat, int Expected, const unsigned char *pExpected, int Result, const unsigned char *pResult)
+{
+	if(Result != Expected || (Expected > 0 && memcmp(pExpected, pResult, Expected) != 0))
+	{
+		fprintf(stderr, "%s: expected %d bytes, got %d\n", pWhat, Expected, Result);
+		abort();
+	}
+}
+
+/* frequencies of the tables besides the default one */
+static void FuzzInitTables(void)
+{
+	unsigned aText[HUFFMAN_MAX_SYMBOLS-1];
+	unsigned aSkewed[HUFFMAN_MAX_SYMBOLS-1];
+	unsigned i;
+
+	for(i = 0; i < HUFFMAN_MAX_SYMBOLS-1; i++)
+	{
+		/* lowercase and space first, then the rest of ascii, control characters and the high half barely */
+		aText[i] = 1 + (i >= 'a' && i <= 'z' ? 4000 + (i*37)%3000 : 0) + (i == ' ' ? 12000 : 0) + (i >= ' ' && i < 127 ? 300 : 0) + (i < ' ' ? 20 : 0);
+		/* doubling frequencies give a tree as deep as there are of them */
+		aSkewed[i] = i < 30 ? 1u<<i : 1;
+	}
+
+	HuffmanInit(&s_aHuffman[0], NULL);
+	HuffmanInit(&s_aHuffman[1], aText);
+	HuffmanInit(&s_aHuffman[2], aSkewed);
+}
+
+/* decodes untrusted input with every decoder */
+static void FuzzDecode(const Huffman *hf, const unsigned char *pData, int Size, int OutputSize)
+{
+	HuffmanPacket aPackets[FUZZ_BATCH];
+	int Expected, i;
+
+	Expected = FuzzReference(hf, pData, Size, s_aReference, OutputSize);
+
+	FuzzCheck("HuffmanDecompress", Expected, s_aReference,
+		HuffmanDecompress(hf, pData, Size, s_aOutput, OutputSize), s_aOutput);
+	FuzzCheck("HuffmanDecompressFast", Expected, s_aReference,
+		HuffmanDecompressFast(hf, pData, Size, s_aOutput, OutputSize), s_aOutput);
+
+	for(i = 0; i < FUZZ_BATCH; i++)
+	{
+		aPackets[i].m_pInput = pData;
+		aPackets[i].m_InputSize = Size;
+		aPackets[i].m_pOutput = s_aaBatch[i];
+		aPackets[i].m_OutputSize = OutputSize;
+	}
+	HuffmanDecompressBatch(hf, aPackets, FUZZ_BATCH);
+	for(i = 0; i < FUZZ_BATCH; i++)
+		FuzzCheck("HuffmanDecompressBatch", Expected, s_aReference, aPackets[i].m_Result, s_aaBatch[i]);
+}
+
+/* compresses the input and decodes it with every decoder */
+static void FuzzRoundtrip(const Huffman *hf, const unsigned char *pData, int Size, int Param)
+{
+	unsigned char aRing[64];
+	HuffmanStream Stream;
+	HuffmanChunked Chunked;
+	int Packed, Result, Fed, Read, i;
+
+	/* codes HuffmanCompress refuses, eof is always coded */
+	if(hf->m_aCodeLengths[HUFFMAN_EOF_SYMBOL] > HUFFMAN_FAST_MAXBITS)
+		return;
+	for(i = 0; i < Size; i++)
+		if(hf->m_aCodeLengths[pData[i]] > HUFFMAN_FAST_MAXBITS)
+			return;
+
+	Packed = HuffmanCompress(hf, pData, Size, s_aPacked, sizeof(s_aPacked));
+	if(Packed < 0)
+	{
+		fprintf(stderr, "HuffmanCompress failed on %d bytes\n", Size);
+		abort();
+	}
+	if(HuffmanCompress(hf, pData, Size, s_aOutput, Packed-1) != -1)
+	{
+		fprintf(stderr, "HuffmanCompress didn't notice a short output\n");
+		abort();
+	}
+
+	FuzzDecode(hf, s_aPacked, Packed, Size);
+	FuzzCheck("reference", Size, pData, FuzzReference(hf, s_aPacked, Packed, s_aReference, Size), s_aReference);
+
+	/* the stream gets the input in small pieces through a small ring */
+	HuffmanStreamInit(&Stream, hf, aRing, 1 + Param%(int)sizeof(aRing));
+	Fed = Read = 0;
+	while(1)
+	{
+		int Chunk = Packed - Fed < 1 + Param%17 ? Packed - Fed : 1 + Param%17;
+		int NumFed = HuffmanStreamFeed(&Stream, s_aPacked + Fed, Chunk);
+		int NumRead = HuffmanStreamRead(&Stream, s_aOutput + Read, FUZZ_MAXOUTPUT - Read);
+		if(!NumFed && !NumRead)
+			break;
+		Fed += NumFed;
+		Read += NumRead;
+	}
+	FuzzCheck("HuffmanStreamFeed", Size, pData, HuffmanStreamFinish(&Stream) == Read ? Read : -1, s_aOutput);
+
+	/* the container, reading from somewhere in the middle too */
+	Result = HuffmanChunkedCompress(hf, pData, Size, 1 + Param*7, s_aContainer, sizeof(s_aContainer));
+	if(Result < 0 || HuffmanChunkedOpen(&Chunked, s_aContainer, Result) != 0)
+	{
+		fprintf(stderr, "HuffmanChunkedCompress failed on %d bytes\n", Size);
+		abort();
+	}
+	FuzzCheck("HuffmanChunkedDecompress", Size, pData,
+		HuffmanChunkedDecompress(hf, &Chunked, s_aReference, FUZZ_MAXOUTPUT), s_aReference);
+	if(Size > 0)
+	{
+		int Offset = Param*131 % Size;
+		FuzzCheck("HuffmanChunkedRead", (Size-Offset)/2, pData + Offset,
+			HuffmanChunkedRead(hf, &Chunked, Offset, s_aReference, (Size-Offset)/2, s_aaBatch[0]), s_aReference);
+	}
+}
+
+/* opens untrusted input as a container, each block has to agree with the reference loop */
+static void FuzzChunked(const Huffman *hf, const unsigned char *pData, int Size, int Param)
+{
+	HuffmanChunked Chunked;
+	int Expected = 0, Failed = 0, Block;
+
+	if(HuffmanChunkedOpen(&Chunked, pData, Size) != 0 || Chunked.m_Size > FUZZ_MAXOUTPUT)
+		return;
+
+	for(Block = 0; Block < Chunked.m_NumBlocks; Block++)
+	{
+		const unsigned char *pEntry = Chunked.m_pIndex + Block*HUFFMAN_CHUNKED_ENTRYSIZE;
+		int Start = HuffmanChunkedBlockOffset(&Chunked, Block);
+		int End = HuffmanChunkedBlockOffset(&Chunked, Block+1);
+		int Packed = (int)(pEntry[0] | (pEntry[1]<<8) | ((unsigned)pEntry[2]<<16) | ((unsigned)pEntry[3]<<24));
+		int PackedEnd = (int)(pEntry[8] | (pEntry[9]<<8) | ((unsigned)pEntry[10]<<16) | ((unsigned)pEntry[11]<<24));
+
+		if(FuzzReference(hf, Chunked.m_pData + Packed, PackedEnd - Packed, s_aReference + Start, End - Start) != End - Start)
+			Failed = 1;
+	}
+	if(!Failed)
+		Expected = Chunked.m_Size;
+
+	FuzzCheck("HuffmanChunkedDecompress", Failed ? -1 : Expected, s_aReference,
+		HuffmanChunkedDecompress(hf, &Chunked, s_aOutput, FUZZ_MAXOUTPUT), s_aOutput);
+	if(!Failed && Chunked.m_Size > 0)
+	{
+		int Offset = Param*257 % Chunked.m_Size;
+		FuzzCheck("HuffmanChunkedRead", Chunked.m_Size - Offset, s_aReference + Offset,
+			HuffmanChunkedRead(hf, &Chunked, Offset, s_aOutput, FUZZ_MAXOUTPUT, s_aaBatch[0]), s_aOutput);
+	}
+}
+
+/* the first byte picks the test and the table, the second one the parameter */
+int LLVMFuzzerTestOneInput(const unsigned char *pData, size_t Size)
+{
+	const Huffman *hf;
+	int Mode, Param;
+
+	if(!s_Initialized)
+	{
+		FuzzInitTables();
+		s_Initialized = 1;
+	}
+
+	if(Size < 2)
+		return 0;
+	Mode = pData[0]%3;
+	hf = &s_aHuffman[pData[0]/3%FUZZ_TABLES];
+	Param = pData[1];
+	pData += 2;
+	Size -= 2;
+	if(Size > FUZZ_MAXINPUT)
+		Size = FUZZ_MAXINPUT;
+
+	if(Mode == 0)
+		FuzzDecode(hf, pData, (int)Size, Param == 255 ? FUZZ_MAXOUTPUT : Param*8);
+	else if(Mode == 1)
+		FuzzRoundtrip(hf, pData, (int)Size, Param);
+	else
+		FuzzChunked(hf, pData, (int)Size, Param);
+	return 0;
+}
+
+#ifndef HUFFMAN_FUZZ_LIBFUZZER
+static void FuzzFile(FILE *pFile)
+{
+	static unsigned char s_aInput[FUZZ_MAXINPUT+2];
+	size_t Size = fread(s_aInput, 1, sizeof(s_aInput), pFile);
+	LLVMFuzzerTestOneInput(s_aInput, Size);
+}
+
+int main(int argc, char **argv)
+{
+	int i;
+
+	if(argc < 2)
+		FuzzFile(stdin);
+	for(i = 1; i < argc; i++)
+	{
+		FILE *pFile = fopen(argv[i], "rb");
+		if(!pFile)
+		{
+			fprintf(stderr, "can't open %s\n", argv[i]);
+			return 1;
+		}
+		FuzzFile(pFile);
+		fclose(pFile);
+	}
+	return 0;
+}
+#endif
@@ -0,0 +1,12 @@
+/* writes the tables HuffmanInit builds for HuffmanFreqTable as C source,
+   compile the result with -DHUFFMAN_PRECOMPUTED to get them as read-only data */
+#include "printtables.h"
+
+int main()
+{
+	static Huffman hf;
+
+	HuffmanInit(&hf, NULL);
+	PrintTables(stdout, &hf, "tools/gentables.c");
+	return 0;
+}
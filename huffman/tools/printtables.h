@@ -0,0 +1,58 @@
+/* writes a Huffman as the C source of HuffmanPrecomputed, used by gentables and train.
+   compile the result with -DHUFFMAN_PRECOMPUTED to get the tables as read-only data */
+#include <stdio.h>
+#include "../huffman.h"
+
+static void PrintArray(FILE *pFile, const char *pName, const unsigned *pData, int Size)
+{
+	int i;
+
+	fprintf(pFile, "\t/* %s */\n\t{", pName);
+	for(i = 0; i < Size; i++)
+		fprintf(pFile, "%s0x%08x%s", i%8 ? " " : "\n\t\t", pData[i], i < Size-1 ? "," : "");
+	fprintf(pFile, "\n\t},\n");
+}
+
+static void PrintShorts(FILE *pFile, const char *pName, const unsigned short *pData, int Size)
+{
+	int i;
+
+	fprintf(pFile, "\t/* %s */\n\t{", pName);
+	for(i = 0; i < Size; i++)
+		fprintf(pFile, "%s0x%04x%s", i%8 ? " " : "\n\t\t", pData[i], i < Size-1 ? "," : "");
+	fprintf(pFile, "\n\t},\n");
+}
+
+static void PrintTables(FILE *pFile, const Huffman *hf, const char *pGenerator)
+{
+	int i;
+
+	fprintf(pFile, "/* generated by %s, do not edit */\n", pGenerator);
+	fprintf(pFile, "#ifdef HUFFMAN_PRECOMPUTED\n");
+	fprintf(pFile, "#include \"huffman.h\"\n\n");
+	fprintf(pFile, "const Huffman HuffmanPrecomputed = {\n");
+
+	fprintf(pFile, "\t/* m_aaLeafs */\n\t{");
+	for(i = 0; i < HUFFMAN_MAX_NODES-HUFFMAN_MAX_SYMBOLS; i++)
+		fprintf(pFile, "%s{0x%x, 0x%x}%s", i%8 ? " " : "\n\t\t", hf->m_aaLeafs[i][0], hf->m_aaLeafs[i][1],
+			i < HUFFMAN_MAX_NODES-HUFFMAN_MAX_SYMBOLS-1 ? "," : "");
+	fprintf(pFile, "\n\t},\n");
+
+	PrintShorts(pFile, "m_aDecodeLut", hf->m_aDecodeLut, HUFFMAN_LUTSIZE);
+	fprintf(pFile, "\t/* m_StartNode */\n\t%u,\n", hf->m_StartNode);
+	fprintf(pFile, "\t/* m_DecodeBatch */\n\t%u,\n", hf->m_DecodeBatch);
+
+	PrintArray(pFile, "m_aCodeBits", hf->m_aCodeBits, HUFFMAN_MAX_SYMBOLS);
+	PrintShorts(pFile, "m_aCodeLengths", hf->m_aCodeLengths, HUFFMAN_MAX_SYMBOLS);
+	fprintf(pFile, "\t/* m_MaxCodeLength */\n\t%u,\n", hf->m_MaxCodeLength);
+
+	PrintArray(pFile, "m_aMultiLut", hf->m_aMultiLut, HUFFMAN_MULTISIZE);
+	PrintArray(pFile, "m_aSubLut", hf->m_aSubLut, HUFFMAN_SUBLUTSIZE);
+	fprintf(pFile, "\t/* m_FastTables */\n\t%d,\n", hf->m_FastTables);
+	PrintArray(pFile, "m_aEncodeLut", hf->m_aEncodeLut, HUFFMAN_MAX_SYMBOLS);
+	fprintf(pFile, "\t/* m_FastEncode */\n\t%d\n", hf->m_FastEncode);
+
+	fprintf(pFile, "};\n\n#else\n");
+	/* an empty file isn't valid ISO C */
+	fprintf(pFile, "typedef int HuffmanTablesUnused;\n#endif\n");
+}
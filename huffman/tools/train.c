@@ -0,0 +1,309 @@
+/* builds a frequency table for HuffmanInit from a corpus of captured payloads.
+   the files are counted in chunks by several threads, the table goes to stdout as C source
+   and the expected bits per symbol with the trained and with the current table to stderr.
+   this one needs POSIX (pthreads and pread), the library itself doesn't */
+#define _POSIX_C_SOURCE 200809L
+#define _FILE_OFFSET_BITS 64
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "printtables.h"
+
+enum
+{
+	TRAIN_CHUNKSIZE = 16<<20,
+	TRAIN_MAXTHREADS = 256,
+	/* the frequencies are scaled down to about this total, so the sums in HuffmanConstructTree fit an int */
+	TRAIN_MAXTOTAL = 1<<30
+};
+
+typedef struct
+{
+	const char *m_pPath;
+	int m_Fd;
+	off_t m_Size;
+} TrainFile;
+
+/* the work queue, the files are split into chunks that are handed out in order */
+typedef struct
+{
+	pthread_mutex_t m_Lock;
+	TrainFile *m_pFiles;
+	int m_NumFiles;
+	int m_File;
+	off_t m_Offset;
+	int m_Failed;
+} TrainQueue;
+
+typedef struct
+{
+	TrainQueue *m_pQueue;
+	pthread_t m_Thread;
+	/* doubles hold exact counts up to 2^53 bytes, without needing long long */
+	double m_aCounts[256];
+} TrainWorker;
+
+/* takes the next chunk, returns 0 when everything was handed out */
+static int TrainNextChunk(TrainQueue *pQueue, TrainFile **ppFile, off_t *pOffset, size_t *pSize)
+{
+	int Found = 0;
+
+	pthread_mutex_lock(&pQueue->m_Lock);
+	while(!pQueue->m_Failed && pQueue->m_File < pQueue->m_NumFiles)
+	{
+		TrainFile *pFile = &pQueue->m_pFiles[pQueue->m_File];
+		if(pQueue->m_Offset >= pFile->m_Size)
+		{
+			pQueue->m_File++;
+			pQueue->m_Offset = 0;
+			continue;
+		}
+
+		*ppFile = pFile;
+		*pOffset = pQueue->m_Offset;
+		*pSize = pFile->m_Size - pQueue->m_Offset < TRAIN_CHUNKSIZE ? (size_t)(pFile->m_Size - pQueue->m_Offset) : TRAIN_CHUNKSIZE;
+		pQueue->m_Offset += *pSize;
+		Found = 1;
+		break;
+	}
+	pthread_mutex_unlock(&pQueue->m_Lock);
+	return Found;
+}
+
+/* counts a chunk with four tables, so runs of the same byte don't wait on each other's increments */
+static void TrainCount(TrainWorker *pWorker, const unsigned char *pData, size_t Size)
+{
+	unsigned aaCounts[4][256];
+	size_t i;
+
+	memset(aaCounts, 0, sizeof(aaCounts));
+	for(i = 0; i+4 <= Size; i += 4)
+	{
+		aaCounts[0][pData[i]]++;
+		aaCounts[1][pData[i+1]]++;
+		aaCounts[2][pData[i+2]]++;
+		aaCounts[3][pData[i+3]]++;
+	}
+	for(; i < Size; i++)
+		aaCounts[0][pData[i]]++;
+
+	for(i = 0; i < 256; i++)
+		pWorker->m_aCounts[i] += (double)aaCounts[0][i] + aaCounts[1][i] + aaCounts[2][i] + aaCounts[3][i];
+}
+
+static void *TrainThread(void *pUser)
+{
+	TrainWorker *pWorker = (TrainWorker *)pUser;
+	TrainQueue *pQueue = pWorker->m_pQueue;
+	unsigned char *pBuffer = (unsigned char *)malloc(TRAIN_CHUNKSIZE);
+	TrainFile *pFile;
+	off_t Offset;
+	size_t Size;
+
+	if(!pBuffer)
+	{
+		pthread_mutex_lock(&pQueue->m_Lock);
+		pQueue->m_Failed = 1;
+		pthread_mutex_unlock(&pQueue->m_Lock);
+		return NULL;
+	}
+
+	while(TrainNextChunk(pQueue, &pFile, &Offset, &Size))
+	{
+		size_t Done = 0;
+		while(Done < Size)
+		{
+			ssize_t Read = pread(pFile->m_Fd, pBuffer + Done, Size - Done, Offset + (off_t)Done);
+			if(Read <= 0)
+			{
+				if(Read < 0 && errno == EINTR)
+					continue;
+				fprintf(stderr, "can't read %s\n", pFile->m_pPath);
+				pthread_mutex_lock(&pQueue->m_Lock);
+				pQueue->m_Failed = 1;
+				pthread_mutex_unlock(&pQueue->m_Lock);
+				break;
+			}
+			Done += (size_t)Read;
+		}
+		TrainCount(pWorker, pBuffer, Done);
+	}
+
+	free(pBuffer);
+	return NULL;
+}
+
+/* expected bits per symbol of the counted data with the codes of hf */
+static double TrainBitsPerSymbol(const Huffman *hf, const double *pCounts, double Total)
+{
+	double Bits = 0;
+	int i;
+
+	for(i = 0; i < 256; i++)
+		Bits += pCounts[i] * hf->m_aCodeLengths[i];
+	return Total > 0 ? Bits/Total : 0;
+}
+
+static unsigned TrainMaxCodeLength(const Huffman *hf)
+{
+	unsigned MaxBits = 0;
+	int i;
+
+	for(i = 0; i < HUFFMAN_MAX_SYMBOLS; i++)
+		if(hf->m_aCodeLengths[i] > MaxBits)
+			MaxBits = hf->m_aCodeLengths[i];
+	return MaxBits;
+}
+
+static void Usage(const char *pName)
+{
+	fprintf(stderr, "usage: %s [-j threads] [-n table name] [-p huffman_tables.c] files...\n", pName);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	static Huffman Trained, Current;
+	static TrainWorker aWorkers[TRAIN_MAXTHREADS];
+	const char *pName = "TrainedFreqTable";
+	const char *pTablesPath = NULL;
+	TrainQueue Queue;
+	double aCounts[256];
+	unsigned aFrequencies[256];
+	double Total = 0, Entropy = 0;
+	long NumThreads = sysconf(_SC_NPROCESSORS_ONLN);
+	int Arg, i, t;
+
+	for(Arg = 1; Arg < argc && argv[Arg][0] == '-'; Arg++)
+	{
+		if(strcmp(argv[Arg], "-j") == 0 && Arg+1 < argc)
+			NumThreads = atol(argv[++Arg]);
+		else if(strcmp(argv[Arg], "-n") == 0 && Arg+1 < argc)
+			pName = argv[++Arg];
+		else if(strcmp(argv[Arg], "-p") == 0 && Arg+1 < argc)
+			pTablesPath = argv[++Arg];
+		else
+			Usage(argv[0]);
+	}
+	if(Arg == argc)
+		Usage(argv[0]);
+	if(NumThreads < 1)
+		NumThreads = 1;
+	if(NumThreads > TRAIN_MAXTHREADS)
+		NumThreads = TRAIN_MAXTHREADS;
+
+	/* open everything first, so a typo doesn't show up after an hour of counting */
+	memset(&Queue, 0, sizeof(Queue));
+	pthread_mutex_init(&Queue.m_Lock, NULL);
+	Queue.m_NumFiles = argc - Arg;
+	Queue.m_pFiles = (TrainFile *)calloc(Queue.m_NumFiles, sizeof(TrainFile));
+	if(!Queue.m_pFiles)
+		return 1;
+	for(i = 0; i < Queue.m_NumFiles; i++)
+	{
+		TrainFile *pFile = &Queue.m_pFiles[i];
+		struct stat Stat;
+
+		pFile->m_pPath = argv[Arg+i];
+		pFile->m_Fd = open(pFile->m_pPath, O_RDONLY);
+		if(pFile->m_Fd < 0 || fstat(pFile->m_Fd, &Stat) != 0)
+		{
+			fprintf(stderr, "can't open %s: %s\n", pFile->m_pPath, strerror(errno));
+			return 1;
+		}
+		pFile->m_Size = Stat.st_size;
+	}
+
+	for(t = 0; t < NumThreads; t++)
+	{
+		aWorkers[t].m_pQueue = &Queue;
+		if(pthread_create(&aWorkers[t].m_Thread, NULL, TrainThread, &aWorkers[t]) != 0)
+		{
+			fprintf(stderr, "can't start thread %d\n", t);
+			return 1;
+		}
+	}
+
+	memset(aCounts, 0, sizeof(aCounts));
+	for(t = 0; t < NumThreads; t++)
+	{
+		pthread_join(aWorkers[t].m_Thread, NULL);
+		for(i = 0; i < 256; i++)
+			aCounts[i] += aWorkers[t].m_aCounts[i];
+	}
+	for(i = 0; i < Queue.m_NumFiles; i++)
+		close(Queue.m_pFiles[i].m_Fd);
+	if(Queue.m_Failed)
+		return 1;
+
+	for(i = 0; i < 256; i++)
+		Total += aCounts[i];
+	if(Total == 0)
+	{
+		fprintf(stderr, "the corpus is empty\n");
+		return 1;
+	}
+	for(i = 0; i < 256; i++)
+		if(aCounts[i] > 0)
+			Entropy -= aCounts[i]/Total * log(aCounts[i]/Total)/log(2.0);
+
+	/* scale to the maximum total, bytes that never showed up still need a code */
+	for(i = 0; i < 256; i++)
+	{
+		double Scaled = aCounts[i] * ((double)TRAIN_MAXTOTAL/2/Total);
+		aFrequencies[i] = Scaled < 1 ? 1 : (unsigned)Scaled;
+	}
+
+	/* flatten rare bytes until every code fits the fast decoder and its sub tables */
+	while(1)
+	{
+		int Changed = 0;
+
+		HuffmanInit(&Trained, aFrequencies);
+		if(TrainMaxCodeLength(&Trained) <= HUFFMAN_FAST_MAXBITS && Trained.m_FastTables)
+			break;
+		for(i = 0; i < 256; i++)
+		{
+			unsigned Flat = aFrequencies[i] > 2 ? aFrequencies[i]/2 : 1;
+			Changed |= Flat != aFrequencies[i];
+			aFrequencies[i] = Flat;
+		}
+		if(!Changed)
+		{
+			fprintf(stderr, "can't flatten the table for the fast decoder\n");
+			return 1;
+		}
+	}
+	HuffmanInit(&Current, NULL);
+
+	fprintf(stderr, "%.0f bytes in %d files\n", Total, Queue.m_NumFiles);
+	fprintf(stderr, "bits per symbol: %.4f with HuffmanFreqTable, %.4f trained, %.4f entropy\n",
+		TrainBitsPerSymbol(&Current, aCounts, Total), TrainBitsPerSymbol(&Trained, aCounts, Total), Entropy);
+	fprintf(stderr, "longest code: %u bits, fast tables: %s\n", TrainMaxCodeLength(&Trained), Trained.m_FastTables ? "yes" : "no");
+
+	printf("/* generated by tools/train.c from %.0f bytes, pass it to HuffmanInit */\n", Total);
+	printf("static const unsigned %s[256] = {", pName);
+	for(i = 0; i < 256; i++)
+		printf("%s%u%s", i%20 ? "" : "\n\t", aFrequencies[i], i < 255 ? "," : "");
+	printf("};\n");
+
+	if(pTablesPath)
+	{
+		FILE *pFile = fopen(pTablesPath, "w");
+		if(!pFile)
+		{
+			fprintf(stderr, "can't write %s\n", pTablesPath);
+			return 1;
+		}
+		PrintTables(pFile, &Trained, "tools/train.c");
+		fclose(pFile);
+	}
+
+	free(Queue.m_pFiles);
+	return 0;
+}
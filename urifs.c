@@ -17,10 +17,34 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
  *
  *
- * Requirement: libfuse, libcurl, libxml2 and libcrypto (openssl)
+ * Requirement: libfuse, libcurl (7.68 or newer), libxml2 and libcrypto (openssl)
  *
  * Compile with: gcc -g -o urifs urifs.c -Wall -ansi -W -std=c99 -D_GNU_SOURCE `pkg-config --cflags --libs libxml-2.0 fuse libcurl libcrypto`
  *
+ * Usage: urifs [options] manifest mountpoint
+ * The manifest is the XML or a compiled one, made with: urifs --compile manifest.xml manifest.urifs
+ * A compiled manifest is mapped instead of parsed, so mounting takes no time and its pages are
+ * only read when they're used. It's in the byte order of the machine that compiled it.
+ *
+ * The manifest is watched and loaded again when it's written or replaced, files that are open
+ * keep reading what they were opened as. Blocks of files that changed are dropped from the cache.
+ * A compiled manifest is only loaded again when a new one is renamed over it, write it to a
+ * temporary file in the same directory first (--compile does). Written in place, it would
+ * change under the mapping.
+ *
+ * Options:
+ *   -o block_size=SIZE   size of the ranges fetched from the server and kept in memory (default 128k)
+ *   -o cache_size=SIZE   memory used for cached blocks (default 64m), 0 keeps nothing between reads
+ *   -o readahead=SIZE    most a file that's read sequentially is fetched ahead of the reader (default 4m)
+ *   -o parallel=N        most ranges a large read or a prefetch is split into (default 4)
+ *   -o connections=N     most connections to a host (default 16)
+ *   -o header_ttl=SECS   how long the output of a header-cmd is used for (default 300), it's run
+ *                        again in the background before then if files with it are still opened.
+ *                        0 runs it for every open
+ *   -o disk_cache=DIR    keep fetched blocks in DIR too, they're read from there after a remount
+ *   -o disk_cache_size=SIZE  most DIR holds, the least recently opened files go first (default 1g)
+ * SIZE takes a k, m or g suffix.
+ *
  */
 
 #define FUSE_USE_VERSION 26
@@ -32,28 +56,291 @@
 #include <stdlib.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <stdint.h>
+#include <strings.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <poll.h>
 #include <curl/curl.h>
 #include <pthread.h>
 #include <openssl/crypto.h>
 
 #include <libxml/tree.h>
 #include <libxml/parser.h>
-#include <libxml/xpath.h>
-#include <libxml/xpathInternals.h>
 
-#define MAX_ENTRIES	512
+#define FILE_CHUNK	1024
+#define FILE_CHUNKS	4096
+#define FILE_NONE	0xffffffffu
 #define LOG_FILE	"/var/log/urifs.log"
+#define BLOCK_SIZE	(128*1024)
+#define CACHE_SIZE	(64*1024*1024)
+#define READAHEAD_SIZE	(4*1024*1024)
+#define PREFETCH_THREADS	4
+#define POOL_SIZE	16
+#define PARALLEL_RANGES	4
+#define HEADER_TTL	300
+#define HEADER_BUCKETS	64
+#define MAX_LOAD	64
+#define DISK_CACHE_SIZE	(1024LL*1024*1024)
+#define DISK_BUCKETS	1024
+#define DISK_MAGIC	0x31435255	/* "URC1" */
+#define VALIDATOR_SIZE	128
+
+/* the map file of a cached uri starts with this, then come the uri and a bit for each
+ * block, set once the block is in the data file */
+typedef struct {
+	uint32_t magic;
+	uint32_t block_size;
+	uint32_t uri_size;
+	uint32_t reserved;
+	int64_t size;
+	int64_t mtime;
+	/* the ETag or Last-Modified the blocks came with, empty if the server sent neither */
+	char validator[VALIDATOR_SIZE];
+} disk_header;
+
+/* a uri in the disk cache, DIR/name.data holds its blocks at their offsets in a sparse file.
+ * the files are only open while someone has the uri open */
+typedef struct disk_entry {
+	char name[17];
+	int refs;
+	int data_fd;
+	int map_fd;
+	disk_header header;
+	unsigned char *bitmap;
+	off_t nblocks;
+	off_t map_offset;
+	/* bumped when the blocks are thrown away, a read that started before doesn't count */
+	unsigned generation;
+	/* the first disk_open() is opening the files, the others wait for it */
+	int loading;
+	size_t bytes;
+	time_t used;
+	struct disk_entry *next;
+} disk_entry;
 
 typedef struct {
 	char *uri;
 	size_t size;
 	struct curl_slist *header;
+	/* the open file and each of its queued prefetches hold a reference */
+	int refs;
+	int closed;
+	/* read-ahead state, see read_ahead() */
+	off_t last_block;
+	off_t ahead;
+	size_t window;
+	/* NULL without a disk cache */
+	disk_entry *disk;
 } uri_fd;
 
-uri_fd ** opened_files = NULL;
+/* a place for an open file in the table, slots of released files are kept on a free list.
+ * generation goes up with every release, so a stale handle doesn't find the next file */
+typedef struct {
+	uri_fd *fd;
+	uint32_t generation;
+	uint32_t next;
+} file_slot;
+
+/* the open files, without locks. the table grows by FILE_CHUNK slots at a time. file_free is
+ * the first free slot in the low half and a counter in the high one, so a slot that comes
+ * back to the head between reading and swapping it doesn't go unnoticed */
+static file_slot *file_chunks[FILE_CHUNKS];
+static uint32_t file_slots = 0;
+static uint64_t file_free = FILE_NONE;
+
+#define NODE_NONE	0xffffffffu
+#define MANIFEST_MAGIC	0x31465255	/* "URF1" */
+#define MANIFEST_VERSION	1
+
+enum {
+	NODE_DIR = 1,
+	NODE_SIZE = 2
+};
+
+/* an element of the manifest with its attributes parsed, a compiled manifest holds the same
+ * records. strings are offsets into the string table (0 when not set), the children of a
+ * node are the nchildren records from number children on, sorted by name */
+typedef struct {
+	int64_t size;
+	int64_t atime;
+	int64_t mtime;
+	int64_t ctime;
+	uint32_t mode;
+	uint32_t uid;
+	uint32_t gid;
+	uint32_t flags;
+	uint32_t name;
+	uint32_t uri;
+	uint32_t header;
+	uint32_t header_cmd;
+	uint32_t children;
+	uint32_t nchildren;
+} uri_node;
+
+/* a compiled manifest starts with this, then come count records, root first, and the
+ * string table */
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t count;
+	uint32_t node_size;
+	uint64_t strings_offset;
+	uint64_t strings_size;
+} manifest_header;
+
+/* a compiled manifest, mapped from a file or built from the XML by urifs_init */
+typedef struct {
+	char *image;
+	size_t image_size;
+	/* mapped from a compiled file, which is only reloaded when it's replaced */
+	int compiled;
+	const uri_node *nodes;
+	uint32_t count;
+	const char *strings;
+	size_t strings_size;
+} uri_index;
+
+/* the records while the XML is read, in document order. first, next and last link every
+ * node to its children */
+typedef struct {
+	uri_node *nodes;
+	uint32_t count;
+	uint32_t *first;
+	uint32_t *next;
+	uint32_t *last;
+	char *strings;
+	size_t strings_size;
+	size_t strings_alloc;
+} index_builder;
+
+enum {
+	BLOCK_LOADING,
+	BLOCK_READY,
+	BLOCK_FAILED
+};
+
+/* block_size bytes of a remote file, shared by everyone reading the same uri */
+typedef struct cache_block {
+	char *uri;
+	off_t index;
+	char *data;
+	size_t size;
+	int state;
+	int refs;
+	int referenced;
+	/* in the hash table and the clock, a block that isn't goes with its last reference */
+	int linked;
+	struct cache_block *hash_next;
+	struct cache_block *clock_prev;
+	struct cache_block *clock_next;
+} cache_block;
+
+size_t block_size = BLOCK_SIZE;
+size_t cache_size = CACHE_SIZE;
+
+static cache_block **cache_table = NULL;
+static size_t cache_buckets = 0;
+static cache_block *cache_hand = NULL;
+static size_t cache_used = 0;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cache_loaded = PTHREAD_COND_INITIALIZER;
+
+int parallel = PARALLEL_RANGES;
+long host_connections = POOL_SIZE;
+
+/* averages over the ranges fetched so far, under cache_lock. latency is in seconds to the
+ * first byte, rate in bytes per second after it */
+static double fetch_latency = 0;
+static double fetch_rate = 0;
+
+char *disk_dir = NULL;
+size_t disk_size = DISK_CACHE_SIZE;
+
+static disk_entry **disk_table = NULL;
+static size_t disk_used = 0;
+static pthread_mutex_t disk_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t disk_loaded = PTHREAD_COND_INITIALIZER;
+
+typedef struct prefetch_job {
+	uri_fd *fd;
+	off_t index;
+	off_t count;
+	struct prefetch_job *next;
+} prefetch_job;
+
+size_t readahead_size = READAHEAD_SIZE;
+
+static pthread_t prefetch_threads[PREFETCH_THREADS];
+static prefetch_job *prefetch_head = NULL;
+static prefetch_job *prefetch_tail = NULL;
+static int prefetch_stop = 0;
+static pthread_mutex_t prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prefetch_queued = PTHREAD_COND_INITIALIZER;
+
+/* idle easy handles, so a request doesn't have to set one up. the share gives them
+ * common DNS and TLS session caches */
+static CURL *curl_pool[POOL_SIZE];
+static int curl_pooled = 0;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static CURLSH *curl_share = NULL;
+static pthread_mutex_t share_locks[CURL_LOCK_DATA_LAST];
+
+/* a transfer handed to the I/O thread, the caller waits for done */
+typedef struct fetch_request {
+	CURL *curl_handle;
+	CURLcode result;
+	int done;
+	pthread_cond_t finished;
+	struct fetch_request *next;
+} fetch_request;
+
+/* every transfer runs on curl_multi in the I/O thread, it owns the connections */
+static CURLM *curl_multi = NULL;
+static pthread_t engine_thread;
+static fetch_request *engine_head = NULL;
+static fetch_request *engine_tail = NULL;
+static int engine_stop = 0;
+static pthread_mutex_t engine_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* the output of a header-cmd, shared by the opens of every file with that command */
+typedef struct header_entry {
+	char *cmd;
+	struct curl_slist *lines;
+	/* seconds on CLOCK_MONOTONIC */
+	time_t fetched;
+	/* how often it has run, 0 until the first run is done */
+	unsigned runs;
+	int running;
+	/* opened since the last run, so it's refreshed before it expires */
+	int wanted;
+	struct header_entry *next;
+} header_entry;
+
+long header_ttl = HEADER_TTL;
+
+static header_entry *header_table[HEADER_BUCKETS];
+static pthread_t header_tid;
+static int header_stop = 0;
+static pthread_mutex_t header_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t header_done = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t header_wake;
 
 char *source_xml;
 
+/* the manifest in use, see index_enter(). readers count themselves on the side of the
+ * epoch they came in */
+static uri_index *current_index = NULL;
+static unsigned index_epoch = 0;
+static long index_readers[2];
+
+static int manifest_inotify = -1;
+static int manifest_pipe[2];
+static pthread_t manifest_tid;
+
 FILE *debug_f = NULL;
 FILE *error_f = NULL;
 
@@ -103,278 +390,2308 @@ static void init_locks(void)
  
 static void kill_locks(void)
 {
-	int i;
- 
-	CRYPTO_set_locking_callback(NULL);
-	for (i=0; i<CRYPTO_num_locks(); i++)
-		pthread_mutex_destroy(&(lockarray[i]));
- 
-	OPENSSL_free(lockarray);
+	int i;
+ 
+	CRYPTO_set_locking_callback(NULL);
+	for (i=0; i<CRYPTO_num_locks(); i++)
+		pthread_mutex_destroy(&(lockarray[i]));
+ 
+	OPENSSL_free(lockarray);
+}
+
+
+/* a string of the string table, NULL if it isn't set */
+static inline const char *index_string(const uri_index *index, uint32_t offset)
+{
+	return offset && offset < index->strings_size ? index->strings + offset : NULL;
+}
+
+static inline const char *index_name(const uri_index *index, const uri_node *node)
+{
+	const char *name = index_string(index, node->name);
+	return name ? name : "";
+}
+
+/* the children of node are first to end-1, none if they're out of bounds */
+static void index_children(const uri_index *index, const uri_node *node, uint32_t *first, uint32_t *end)
+{
+	*first = *end = 0;
+	if(node->nchildren && node->children < index->count && node->nchildren <= index->count - node->children)
+	{
+		*first = node->children;
+		*end = node->children + node->nchildren;
+	}
+}
+
+/* compares str to the len bytes at name like strcmp */
+static int index_compare(const char *str, const char *name, size_t len)
+{
+	int cmp = strncmp(str, name, len);
+	if(cmp == 0 && str[len] != '\0')
+		return 1;
+	return cmp;
+}
+
+/* the node of a path like "/dir/file", NULL if there's none. of several siblings with the
+ * same name it finds the first one */
+static const uri_node *index_lookup(const uri_index *index, const char *path)
+{
+	const uri_node *node = &index->nodes[0];
+	while(1)
+	{
+		const char *name;
+		size_t len;
+		uint32_t first, end, limit;
+
+		while(*path == '/')
+			path++;
+		if(!*path)
+			return node;
+		name = path;
+		while(*path && *path != '/')
+			path++;
+		len = path - name;
+
+		index_children(index, node, &first, &end);
+		limit = end;
+		while(first < end)
+		{
+			uint32_t middle = first + (end - first) / 2;
+			if(index_compare(index_name(index, &index->nodes[middle]), name, len) < 0)
+				first = middle + 1;
+			else
+				end = middle;
+		}
+		if(first == limit || index_compare(index_name(index, &index->nodes[first]), name, len) != 0)
+			return NULL;
+		node = &index->nodes[first];
+	}
+}
+
+static void index_stat(const uri_node *node, struct stat *stbuf)
+{
+	stbuf->st_ino = 0;
+	stbuf->st_mode = node->mode;
+	stbuf->st_nlink = 0;
+	stbuf->st_uid = node->uid;
+	stbuf->st_gid = node->gid;
+	stbuf->st_rdev = 0;
+	stbuf->st_size = node->size;
+	stbuf->st_blksize = 1;
+	stbuf->st_blocks = node->size;
+	stbuf->st_atime = node->atime;
+	stbuf->st_mtime = node->mtime;
+	stbuf->st_ctime = node->ctime;
+}
+
+/* copies str to the string table */
+static int index_intern(index_builder *builder, const char *str, uint32_t *offset)
+{
+	size_t len = strlen(str) + 1;
+
+	if(builder->strings_size + len > NODE_NONE)
+		return -1;
+	if(builder->strings_size + len > builder->strings_alloc)
+	{
+		size_t alloc = (builder->strings_size + len) * 2;
+		char *strings = (char*)realloc(builder->strings, alloc);
+		if(!strings)
+			return -1;
+		builder->strings = strings;
+		builder->strings_alloc = alloc;
+	}
+	memcpy(builder->strings + builder->strings_size, str, len);
+	*offset = builder->strings_size;
+	builder->strings_size += len;
+	return 0;
+}
+
+/* copies an attribute to the string table, the offset is 0 if it isn't set */
+static int index_prop(index_builder *builder, xmlNodePtr xml, const char *name, uint32_t *offset)
+{
+	int ret = 0;
+	xmlChar *value = xmlGetProp(xml, (xmlChar*)name);
+	*offset = 0;
+	if(value)
+	{
+		ret = index_intern(builder, (char*)value, offset);
+		xmlFree(value);
+	}
+	return ret;
+}
+
+static int index_parse(index_builder *builder, uri_node *node, xmlNodePtr xml)
+{
+	xmlChar *value;
+
+	if(strcmp((char*)xml->name, "dir")==0 || strcmp((char*)xml->name, "root")==0)
+	{
+		node->flags |= NODE_DIR;
+		node->mode = S_IFDIR | S_IXUSR | S_IXGRP | S_IXOTH;
+	}
+	else
+		node->mode = S_IFREG;
+	node->mode |= S_IRUSR | S_IRGRP | S_IROTH /*| S_IWUSR | S_IWGRP | S_IWOTH*/;
+	node->size = 1;
+
+	value = xmlGetProp(xml, (xmlChar*)"size");
+	if(value)
+	{
+		node->size = atoll((char*)value);
+		node->flags |= NODE_SIZE;
+		xmlFree(value);
+	}
+
+	value = xmlGetProp(xml, (xmlChar*)"uid");
+	if(value)
+	{
+		node->uid = atoi((char*)value);
+		xmlFree(value);
+	}
+
+	value = xmlGetProp(xml, (xmlChar*)"gid");
+	if(value)
+	{
+		node->gid = atoi((char*)value);
+		xmlFree(value);
+	}
+
+	value = xmlGetProp(xml, (xmlChar*)"mode");
+	if(value)
+	{
+		node->mode &= S_IFMT;
+		node->mode |= strtol((char*)value, NULL, 8);
+		xmlFree(value);
+	}
+
+	value = xmlGetProp(xml, (xmlChar*)"ctime");
+	if(value)
+	{
+		node->ctime = atoi((char*)value);
+		xmlFree(value);
+	}
+
+	value = xmlGetProp(xml, (xmlChar*)"atime");
+	if(value)
+	{
+		node->atime = atoi((char*)value);
+		xmlFree(value);
+	}
+
+	value = xmlGetProp(xml, (xmlChar*)"mtime");
+	if(value)
+	{
+		node->mtime = atoi((char*)value);
+		xmlFree(value);
+	}
+
+	if(index_prop(builder, xml, "uri", &node->uri) != 0
+		|| index_prop(builder, xml, "header", &node->header) != 0
+		|| index_prop(builder, xml, "header-cmd", &node->header_cmd) != 0)
+		return -1;
+	return 0;
+}
+
+static size_t index_count(xmlNodePtr xml)
+{
+	size_t count = 1;
+	xmlNodePtr child;
+	for(child = xml->children; child; child = child->next)
+		if(child->type == XML_ELEMENT_NODE)
+			count += index_count(child);
+	return count;
+}
+
+/* adds xml and the elements under it that have a name */
+static int index_add(index_builder *builder, uint32_t parent, xmlNodePtr xml, uint32_t name)
+{
+	uint32_t number = builder->count++;
+	uri_node *node = &builder->nodes[number];
+	xmlNodePtr child;
+
+	memset(node, 0, sizeof(uri_node));
+	node->name = name;
+	builder->first[number] = builder->next[number] = builder->last[number] = NODE_NONE;
+	if(index_parse(builder, node, xml) != 0)
+		return -1;
+
+	if(parent != NODE_NONE)
+	{
+		if(builder->last[parent] != NODE_NONE)
+			builder->next[builder->last[parent]] = number;
+		else
+			builder->first[parent] = number;
+		builder->last[parent] = number;
+	}
+
+	for(child = xml->children; child; child = child->next)
+	{
+		if(child->type != XML_ELEMENT_NODE)
+			continue;
+		if(index_prop(builder, child, "name", &name) != 0)
+			return -1;
+		if(name && index_add(builder, number, child, name) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+/* by name, siblings with the same name stay in document order */
+static int index_sort_compare(const void *a, const void *b, void *arg)
+{
+	const index_builder *builder = (const index_builder*)arg;
+	uint32_t x = *(const uint32_t*)a;
+	uint32_t y = *(const uint32_t*)b;
+	int cmp = strcmp(builder->strings + builder->nodes[x].name, builder->strings + builder->nodes[y].name);
+	return cmp ? cmp : (x > y) - (x < y);
+}
+
+/* puts the records in breadth first order into a compiled manifest, so the children of each
+ * node are next to each other, sorted by name. of several siblings with the same name the
+ * first one gets the children of all of them, that's what the XPath lookups used to see */
+static char *index_layout(index_builder *builder, size_t *size)
+{
+	size_t strings_offset = sizeof(manifest_header) + (size_t)builder->count * sizeof(uri_node);
+	char *image = (char*)malloc(strings_offset + builder->strings_size);
+	uint32_t *source = (uint32_t*)malloc(builder->count * sizeof(uint32_t));
+	uint32_t *children = (uint32_t*)malloc(builder->count * sizeof(uint32_t));
+	manifest_header *header = (manifest_header*)image;
+	uri_node *nodes = (uri_node*)(image + sizeof(manifest_header));
+	uint32_t count = 1;
+	uint32_t i;
+
+	if(!image || !source || !children)
+	{
+		xfree(image);
+		xfree(source);
+		xfree(children);
+		return NULL;
+	}
+
+	nodes[0] = builder->nodes[0];
+	source[0] = 0;
+	for(i = 0; i < count; i++)
+	{
+		uint32_t nchildren = 0;
+		uint32_t child, j, owner = 0;
+
+		for(child = builder->first[source[i]]; child != NODE_NONE; child = builder->next[child])
+			children[nchildren++] = child;
+		qsort_r(children, nchildren, sizeof(uint32_t), index_sort_compare, builder);
+
+		for(j = 1; j < nchildren; j++)
+		{
+			uint32_t first = children[owner];
+			uint32_t dup = children[j];
+			if(strcmp(builder->strings + builder->nodes[first].name, builder->strings + builder->nodes[dup].name) != 0)
+			{
+				owner = j;
+				continue;
+			}
+			if(builder->first[dup] == NODE_NONE)
+				continue;
+			if(builder->first[first] != NODE_NONE)
+				builder->next[builder->last[first]] = builder->first[dup];
+			else
+				builder->first[first] = builder->first[dup];
+			builder->last[first] = builder->last[dup];
+			builder->first[dup] = NODE_NONE;
+		}
+
+		nodes[i].children = nchildren ? count : 0;
+		nodes[i].nchildren = nchildren;
+		for(j = 0; j < nchildren; j++)
+		{
+			nodes[count] = builder->nodes[children[j]];
+			source[count] = children[j];
+			count++;
+		}
+	}
+	xfree(source);
+	xfree(children);
+
+	header->magic = MANIFEST_MAGIC;
+	header->version = MANIFEST_VERSION;
+	header->count = count;
+	header->node_size = sizeof(uri_node);
+	header->strings_offset = strings_offset;
+	header->strings_size = builder->strings_size;
+	memcpy(image + strings_offset, builder->strings, builder->strings_size);
+	*size = strings_offset + builder->strings_size;
+	return image;
+}
+
+/* checks a compiled manifest and makes an index of it, the index takes image */
+static uri_index *index_open(char *image, size_t size, int compiled)
+{
+	const manifest_header *header = (const manifest_header*)image;
+	uri_index *index;
+
+	if(size < sizeof(manifest_header) || header->magic != MANIFEST_MAGIC || header->version != MANIFEST_VERSION
+		|| header->node_size != sizeof(uri_node) || header->count == 0
+		|| header->count > (size - sizeof(manifest_header)) / sizeof(uri_node)
+		|| header->strings_offset < sizeof(manifest_header) + (uint64_t)header->count * sizeof(uri_node)
+		|| header->strings_offset > size || header->strings_size == 0 || header->strings_size > size - header->strings_offset
+		|| image[header->strings_offset + header->strings_size - 1] != '\0')
+		return NULL;
+
+	index = (uri_index*)calloc(1, sizeof(uri_index));
+	if(!index)
+		return NULL;
+	index->image = image;
+	index->image_size = size;
+	index->compiled = compiled;
+	index->nodes = (const uri_node*)(image + sizeof(manifest_header));
+	index->count = header->count;
+	index->strings = image + header->strings_offset;
+	index->strings_size = header->strings_size;
+	return index;
+}
+
+static void index_free(uri_index *index)
+{
+	if(index->compiled)
+		munmap(index->image, index->image_size);
+	else
+		xfree(index->image);
+	xfree(index);
+}
+
+/* a compiled manifest of the XML, NULL if it isn't a manifest */
+static char *index_compile(xmlDocPtr doc, size_t *size)
+{
+	xmlNodePtr root = xmlDocGetRootElement(doc);
+	index_builder builder;
+	char *image = NULL;
+	uint32_t name;
+	size_t count;
+
+	if(!root || strcmp((char*)root->name, "root") != 0)
+		return NULL;
+	count = index_count(root);
+	if(count >= NODE_NONE)
+		return NULL;
+
+	memset(&builder, 0, sizeof(builder));
+	builder.nodes = (uri_node*)malloc(count * sizeof(uri_node));
+	builder.first = (uint32_t*)malloc(count * sizeof(uint32_t));
+	builder.next = (uint32_t*)malloc(count * sizeof(uint32_t));
+	builder.last = (uint32_t*)malloc(count * sizeof(uint32_t));
+	/* offset 0 stands for strings that aren't set */
+	builder.strings_size = 1;
+	if(builder.nodes && builder.first && builder.next && builder.last
+		&& index_intern(&builder, "", &name) == 0 && index_add(&builder, NODE_NONE, root, name) == 0)
+	{
+		builder.strings[0] = '\0';
+		image = index_layout(&builder, size);
+	}
+
+	xfree(builder.nodes);
+	xfree(builder.first);
+	xfree(builder.next);
+	xfree(builder.last);
+	xfree(builder.strings);
+	return image;
+}
+
+/* maps a compiled manifest or reads the XML, NULL if path is neither */
+static uri_index *index_load(const char *path)
+{
+	uint32_t magic = 0;
+	uri_index *index = NULL;
+	char *image;
+	size_t size;
+	xmlDocPtr doc;
+	FILE *f = fopen(path, "rb");
+
+	if(!f)
+		return NULL;
+	if(fread(&magic, sizeof(magic), 1, f) != 1)
+		magic = 0;
+
+	if(magic == MANIFEST_MAGIC)
+	{
+		/* a new manifest is renamed over this one, the mapping keeps the old file alive */
+		struct stat st;
+		if(fstat(fileno(f), &st) == 0 && st.st_size > 0)
+		{
+			image = (char*)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+			if(image != MAP_FAILED)
+			{
+				index = index_open(image, st.st_size, 1);
+				if(!index)
+					munmap(image, st.st_size);
+			}
+		}
+		fclose(f);
+		return index;
+	}
+	fclose(f);
+
+	doc = xmlParseFile(path);
+	if(doc == NULL)
+		return NULL;
+	image = index_compile(doc, &size);
+	xmlFreeDoc(doc);
+	if(image)
+	{
+		index = index_open(image, size, 0);
+		if(!index)
+			xfree(image);
+	}
+	return index;
+}
+
+/* a range goes straight into the consecutive blocks it covers */
+struct curl_buffer {
+	cache_block **blocks;
+	size_t size;
+	size_t read;
+};
+
+static size_t curl_get_callback(void *contents, size_t size, size_t nmemb, void *userp)
+{
+	DEBUG("args: void *contents = %p, size_t size = %lu, size_t nmemb = %lu, void *userp = %p", contents, size, nmemb, userp)
+	size_t realsize = size * nmemb;
+	size_t copied = 0;
+	struct curl_buffer *buffer = (struct curl_buffer *)userp;
+	if(buffer->read + realsize > buffer->size)
+		realsize = buffer->size - buffer->read;
+
+	while(copied < realsize)
+	{
+		cache_block *block = buffer->blocks[buffer->read / block_size];
+		size_t start = buffer->read % block_size;
+		size_t len = block_size - start < realsize - copied ? block_size - start : realsize - copied;
+
+		memcpy(block->data + start, (char *)contents + copied, len);
+		buffer->read += len;
+		copied += len;
+	}
+
+	DEBUG("return: %lu", realsize)
+	return realsize;
+}
+
+static time_t header_now(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec;
+}
+
+/* the header lines cmd prints */
+static struct curl_slist *header_run(const char *cmd)
+{
+	DEBUG("args: const char *cmd = \"%s\"", cmd)
+	struct curl_slist *lines = NULL;
+	FILE *fp = popen(cmd, "r");
+	char *line = NULL;
+	size_t len = 0;
+	ssize_t read;
+
+	if (fp != NULL)
+	{
+		while ((read = getline(&line, &len, fp)) > 0 && line)
+		{
+			line[read-1] = '\0';
+			lines = curl_slist_append(lines,line);
+			DEBUG("Added header \"%s\"", line)
+		}
+		xfree(line);
+		pclose(fp);
+	}
+	DEBUG("return: %p", lines)
+	return lines;
+}
+
+/* the entry of cmd, a new one if there's none yet. header_lock must be held */
+static header_entry *header_find(const char *cmd)
+{
+	size_t hash = 5381;
+	const char *p;
+	header_entry *entry;
+
+	for(p = cmd; *p; p++)
+		hash = hash*33 + (unsigned char)*p;
+	hash %= HEADER_BUCKETS;
+	for(entry = header_table[hash]; entry; entry = entry->next)
+		if(strcmp(entry->cmd, cmd) == 0)
+			return entry;
+
+	entry = (header_entry*)calloc(1, sizeof(header_entry));
+	if(!entry)
+		return NULL;
+	entry->cmd = strdup(cmd);
+	if(!entry->cmd)
+	{
+		xfree(entry);
+		return NULL;
+	}
+	entry->next = header_table[hash];
+	header_table[hash] = entry;
+	return entry;
+}
+
+/* runs the command of an entry the caller set running, header_lock must be held. it's let
+ * go while the command runs */
+static void header_refresh(header_entry *entry)
+{
+	struct curl_slist *lines;
+
+	pthread_mutex_unlock(&header_lock);
+	lines = header_run(entry->cmd);
+	pthread_mutex_lock(&header_lock);
+
+	curl_slist_free_all(entry->lines);
+	entry->lines = lines;
+	entry->fetched = header_now();
+	entry->running = 0;
+	entry->runs++;
+	pthread_cond_broadcast(&header_done);
+	/* there's a new time to refresh it */
+	pthread_cond_signal(&header_wake);
+}
+
+/* adds the header lines of cmd to fd. they're kept for header_ttl seconds, whoever needs
+ * them first after that runs cmd again while the others wait for it */
+static void header_cmd(uri_fd *fd, const char *cmd)
+{
+	DEBUG("args: uri_fd *fd = %p, const char *cmd = \"%s\"", fd, cmd)
+	struct curl_slist *line;
+	header_entry *entry;
+
+	pthread_mutex_lock(&header_lock);
+	entry = header_find(cmd);
+	if(!entry)
+	{
+		struct curl_slist *lines;
+		pthread_mutex_unlock(&header_lock);
+		lines = header_run(cmd);
+		for(line = lines; line; line = line->next)
+			fd->header = curl_slist_append(fd->header, line->data);
+		curl_slist_free_all(lines);
+		return;
+	}
+
+	if(!entry->wanted)
+	{
+		entry->wanted = 1;
+		pthread_cond_signal(&header_wake);
+	}
+	while(1)
+	{
+		if(entry->runs && header_now() < entry->fetched + header_ttl)
+			break;
+		if(entry->running)
+		{
+			unsigned runs = entry->runs;
+			while(entry->running && entry->runs == runs)
+				pthread_cond_wait(&header_done, &header_lock);
+			/* a run that started after we came counts, even with header_ttl 0 */
+			if(entry->runs != runs)
+				break;
+			continue;
+		}
+		entry->running = 1;
+		header_refresh(entry);
+		break;
+	}
+
+	for(line = entry->lines; line; line = line->next)
+		fd->header = curl_slist_append(fd->header, line->data);
+	pthread_mutex_unlock(&header_lock);
+}
+
+/* runs the commands that were used since their last run a quarter of header_ttl before
+ * they expire, so opens don't have to wait for them. the others just expire */
+static void *header_thread(void *arg)
+{
+	(void)arg;
+	header_entry *entry;
+	struct timespec wake;
+	time_t now, next;
+	size_t i;
+
+	pthread_mutex_lock(&header_lock);
+	while(!header_stop)
+	{
+	rescan:
+		now = header_now();
+		next = now + (header_ttl > 0 ? header_ttl : 60);
+		for(i = 0; header_ttl > 0 && i < HEADER_BUCKETS; i++)
+		{
+			for(entry = header_table[i]; entry; entry = entry->next)
+			{
+				time_t due = entry->fetched + header_ttl - header_ttl / 4;
+				if(!entry->wanted || entry->running || !entry->runs)
+					continue;
+				if(due > now)
+				{
+					if(due < next)
+						next = due;
+					continue;
+				}
+				DEBUG("refreshing the headers of %s", entry->cmd)
+				entry->wanted = 0;
+				entry->running = 1;
+				header_refresh(entry);
+				if(header_stop)
+					goto stop;
+				goto rescan;
+			}
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &wake);
+		wake.tv_sec += next - now;
+		pthread_cond_timedwait(&header_wake, &header_lock, &wake);
+	}
+stop:
+	pthread_mutex_unlock(&header_lock);
+	return NULL;
+}
+
+static void header_init(void)
+{
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&header_wake, &attr);
+	pthread_condattr_destroy(&attr);
+
+	if(pthread_create(&header_tid, NULL, header_thread, NULL) != 0)
+	{
+		DEBUG("Can't start the header thread")
+		exit(1);
+	}
+}
+
+static void header_cleanup(void)
+{
+	size_t i;
+
+	pthread_mutex_lock(&header_lock);
+	header_stop = 1;
+	pthread_cond_signal(&header_wake);
+	pthread_mutex_unlock(&header_lock);
+	pthread_join(header_tid, NULL);
+	pthread_cond_destroy(&header_wake);
+
+	for(i = 0; i < HEADER_BUCKETS; i++)
+	{
+		while(header_table[i])
+		{
+			header_entry *entry = header_table[i];
+			header_table[i] = entry->next;
+			curl_slist_free_all(entry->lines);
+			xfree(entry->cmd);
+			xfree(entry);
+		}
+	}
+}
+
+static size_t parse_size(const char *str)
+{
+	char *end;
+	size_t size = strtoull(str, &end, 10);
+	switch(*end)
+	{
+		case 'g': case 'G':
+			size <<= 10;
+			/* fall through */
+		case 'm': case 'M':
+			size <<= 10;
+			/* fall through */
+		case 'k': case 'K':
+			size <<= 10;
+	}
+	return size;
+}
+
+static void share_lock(CURL *handle, curl_lock_data data, curl_lock_access access, void *userptr)
+{
+	(void)handle;
+	(void)access;
+	(void)userptr;
+	pthread_mutex_lock(&share_locks[data]);
+}
+
+static void share_unlock(CURL *handle, curl_lock_data data, void *userptr)
+{
+	(void)handle;
+	(void)userptr;
+	pthread_mutex_unlock(&share_locks[data]);
+}
+
+static void share_init(void)
+{
+	int i;
+
+	for(i=0; i<CURL_LOCK_DATA_LAST; i++)
+		pthread_mutex_init(&share_locks[i], NULL);
+
+	curl_share = curl_share_init();
+	if(!curl_share)
+		return;
+	curl_share_setopt(curl_share, CURLSHOPT_LOCKFUNC, share_lock);
+	curl_share_setopt(curl_share, CURLSHOPT_UNLOCKFUNC, share_unlock);
+	curl_share_setopt(curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt(curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+}
+
+static void share_cleanup(void)
+{
+	int i;
+
+	while(curl_pooled > 0)
+		curl_easy_cleanup(curl_pool[--curl_pooled]);
+	if(curl_share)
+		curl_share_cleanup(curl_share);
+	curl_share = NULL;
+
+	for(i=0; i<CURL_LOCK_DATA_LAST; i++)
+		pthread_mutex_destroy(&share_locks[i]);
+}
+
+static CURL *handle_get(void)
+{
+	CURL *curl_handle = NULL;
+
+	pthread_mutex_lock(&pool_lock);
+	if(curl_pooled > 0)
+		curl_handle = curl_pool[--curl_pooled];
+	pthread_mutex_unlock(&pool_lock);
+
+	if(!curl_handle)
+	{
+		curl_handle = curl_easy_init();
+		if(curl_handle && curl_share)
+			curl_easy_setopt(curl_handle, CURLOPT_SHARE, curl_share);
+	}
+	return curl_handle;
+}
+
+/* forgets the options of the last request, the share stays */
+static void handle_put(CURL *curl_handle)
+{
+	curl_easy_reset(curl_handle);
+
+	pthread_mutex_lock(&pool_lock);
+	if(curl_pooled < POOL_SIZE)
+	{
+		curl_pool[curl_pooled++] = curl_handle;
+		curl_handle = NULL;
+	}
+	pthread_mutex_unlock(&pool_lock);
+
+	if(curl_handle)
+		curl_easy_cleanup(curl_handle);
+}
+
+/* the I/O thread, it adds the queued transfers to curl_multi and drives them all. with
+ * HTTP/2 they're multiplexed on one connection per host, otherwise they wait for one of
+ * host_connections connections to the host */
+static void *engine_run(void *arg)
+{
+	(void)arg;
+	fetch_request *req;
+	CURLMsg *msg;
+	CURLcode result;
+	int running, left;
+
+	pthread_mutex_lock(&engine_lock);
+	while(!engine_stop)
+	{
+		while(engine_head)
+		{
+			req = engine_head;
+			engine_head = req->next;
+			curl_multi_add_handle(curl_multi, req->curl_handle);
+		}
+		engine_tail = NULL;
+		pthread_mutex_unlock(&engine_lock);
+
+		curl_multi_perform(curl_multi, &running);
+		while((msg = curl_multi_info_read(curl_multi, &left)))
+		{
+			char *private;
+
+			if(msg->msg != CURLMSG_DONE)
+				continue;
+			result = msg->data.result;
+			curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &private);
+			curl_multi_remove_handle(curl_multi, msg->easy_handle);
+
+			req = (fetch_request*)private;
+			pthread_mutex_lock(&engine_lock);
+			req->result = result;
+			req->done = 1;
+			pthread_cond_signal(&req->finished);
+			pthread_mutex_unlock(&engine_lock);
+		}
+
+		curl_multi_poll(curl_multi, NULL, 0, 1000, NULL);
+		pthread_mutex_lock(&engine_lock);
+	}
+	pthread_mutex_unlock(&engine_lock);
+	return NULL;
+}
+
+static void engine_init(void)
+{
+	curl_multi = curl_multi_init();
+	if(!curl_multi)
+	{
+		DEBUG("Can't get curl_multi_init")
+		exit(1);
+	}
+	curl_multi_setopt(curl_multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+	curl_multi_setopt(curl_multi, CURLMOPT_MAX_HOST_CONNECTIONS, host_connections);
+	curl_multi_setopt(curl_multi, CURLMOPT_MAXCONNECTS, host_connections > POOL_SIZE ? host_connections : (long)POOL_SIZE);
+
+	if(pthread_create(&engine_thread, NULL, engine_run, NULL) != 0)
+	{
+		DEBUG("Can't start the I/O thread")
+		exit(1);
+	}
+}
+
+static void engine_cleanup(void)
+{
+	pthread_mutex_lock(&engine_lock);
+	engine_stop = 1;
+	pthread_mutex_unlock(&engine_lock);
+	curl_multi_wakeup(curl_multi);
+	pthread_join(engine_thread, NULL);
+
+	curl_multi_cleanup(curl_multi);
+	curl_multi = NULL;
+}
+
+/* hands a transfer to the I/O thread, engine_wait() gets its result */
+static void engine_start(fetch_request *req, CURL *curl_handle)
+{
+	req->curl_handle = curl_handle;
+	req->result = CURLE_OK;
+	req->done = 0;
+	req->next = NULL;
+	pthread_cond_init(&req->finished, NULL);
+	curl_easy_setopt(curl_handle, CURLOPT_PRIVATE, (void *)req);
+
+	pthread_mutex_lock(&engine_lock);
+	if(engine_tail)
+		engine_tail->next = req;
+	else
+		engine_head = req;
+	engine_tail = req;
+	pthread_mutex_unlock(&engine_lock);
+	curl_multi_wakeup(curl_multi);
+}
+
+static CURLcode engine_wait(fetch_request *req)
+{
+	pthread_mutex_lock(&engine_lock);
+	while(!req->done)
+		pthread_cond_wait(&req->finished, &engine_lock);
+	pthread_mutex_unlock(&engine_lock);
+
+	pthread_cond_destroy(&req->finished);
+	return req->result;
+}
+
+/* a range of consecutive blocks on its way, see range_start() */
+typedef struct {
+	uri_fd *fd;
+	off_t offset;
+	struct curl_buffer buffer;
+	char range[48];
+	/* what the server identifies this version of the file with and the bytes it says it
+	 * sent, see curl_header_callback() */
+	char validator[VALIDATOR_SIZE];
+	long long range_first;
+	long long range_last;
+	CURL *curl_handle;
+	fetch_request req;
+	/* seconds to the first byte and bytes per second after it */
+	double latency;
+	double rate;
+} range_fetch;
+
+/* keeps the ETag of a response in the range_fetch userp, or its Last-Modified when there's
+ * no ETag, and the range of its Content-Range */
+static size_t curl_header_callback(char *contents, size_t size, size_t nmemb, void *userp)
+{
+	size_t realsize = size * nmemb;
+	range_fetch *load = (range_fetch *)userp;
+	char *validator = load->validator;
+	const char *kind;
+	size_t skip, len;
+
+	if(realsize > 14 && strncasecmp(contents, "Content-Range:", 14) == 0)
+	{
+		char line[96];
+		snprintf(line, sizeof(line), "%.*s", (int)(realsize - 14), contents + 14);
+		if(sscanf(line, " bytes %lld-%lld", &load->range_first, &load->range_last) != 2)
+			load->range_first = load->range_last = -1;
+		return realsize;
+	}
+	else if(realsize > 5 && strncasecmp(contents, "ETag:", 5) == 0)
+	{
+		kind = "etag";
+		skip = 5;
+	}
+	else if(realsize > 14 && strncasecmp(contents, "Last-Modified:", 14) == 0 && strncmp(validator, "etag ", 5) != 0)
+	{
+		kind = "date";
+		skip = 14;
+	}
+	else
+		return realsize;
+
+	while(skip < realsize && contents[skip] == ' ')
+		skip++;
+	len = realsize - skip;
+	while(len > 0 && (contents[skip+len-1] == '\r' || contents[skip+len-1] == '\n' || contents[skip+len-1] == ' '))
+		len--;
+	snprintf(validator, VALIDATOR_SIZE, "%s %.*s", kind, (int)len, contents+skip);
+	return realsize;
+}
+
+/* starts fetching bytes bytes at offset of fd->uri into blocks, -1 if it can't */
+static int range_start(range_fetch *load, uri_fd *fd, cache_block **blocks, off_t offset, size_t bytes)
+{
+	DEBUG("args: range_fetch *load = %p, uri_fd *fd = %p, cache_block **blocks = %p, off_t offset = %lu, size_t bytes = %lu", load, fd, blocks, offset, bytes)
+	CURL *curl_handle;
+
+	snprintf(load->range, sizeof(load->range), "%llu-%llu", (unsigned long long)offset, (unsigned long long)offset+(unsigned long long)bytes-1);
+	DEBUG("Range: %s (bytes: %llu)", load->range, (unsigned long long)bytes);
+
+	curl_handle = handle_get();
+	if(!curl_handle)
+	{
+		DEBUG("return: -1")
+		return -1;
+	}
+	curl_easy_setopt(curl_handle, CURLOPT_URL, fd->uri);
+
+	curl_easy_setopt(curl_handle, CURLOPT_NOSIGNAL, 1);
+	curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, curl_get_callback);
+	curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, (void *)&load->buffer);
+	curl_easy_setopt(curl_handle, CURLOPT_HEADERFUNCTION, curl_header_callback);
+	curl_easy_setopt(curl_handle, CURLOPT_HEADERDATA, (void *)load);
+	curl_easy_setopt(curl_handle, CURLOPT_RANGE, load->range);
+	curl_easy_setopt(curl_handle, CURLOPT_HTTPHEADER, fd->header);
+	curl_easy_setopt(curl_handle, CURLOPT_FAILONERROR, 1);
+	/* rather wait for a stream on an HTTP/2 connection than open another one */
+	curl_easy_setopt(curl_handle, CURLOPT_PIPEWAIT, 1L);
+
+	load->fd = fd;
+	load->offset = offset;
+	load->buffer.blocks = blocks;
+	load->buffer.size = bytes;
+	load->buffer.read = 0;
+	load->validator[0] = '\0';
+	load->range_first = load->range_last = -1;
+	load->curl_handle = curl_handle;
+	load->latency = load->rate = 0;
+	engine_start(&load->req, curl_handle);
+
+	DEBUG("return: 0")
+	return 0;
+}
+
+/* waits for a range from range_start(), returns how many bytes arrived or -1 */
+static ssize_t range_finish(range_fetch *load)
+{
+	DEBUG("args: range_fetch *load = %p", load)
+	CURLcode res;
+	long http_code = 0;
+	curl_off_t first = 0, total = 0;
+
+	res = engine_wait(&load->req);
+	curl_easy_getinfo(load->curl_handle, CURLINFO_RESPONSE_CODE, &http_code);
+	DEBUG("engine_wait() HTTP code %li", http_code);
+
+	if(res != CURLE_OK)
+	{
+		DEBUG("engine_wait() failed: %s (%s)", curl_easy_strerror(res), load->fd->uri);
+		handle_put(load->curl_handle);
+		DEBUG("return: -1")
+		return -1;
+	}
+
+	/* anything but the range asked for would end up in the wrong blocks, a server without
+	 * ranges can only answer with the whole file when that's what was asked for */
+	if(http_code == 206
+		? load->range_first != (long long)load->offset || load->range_last < load->range_first ||
+			load->range_last >= (long long)(load->offset + load->buffer.size)
+		: http_code != 200 || load->offset != 0 || load->buffer.size != load->fd->size)
+	{
+		DEBUG("unexpected response %li with range %lld-%lld for %s (%s)", http_code, load->range_first, load->range_last, load->range, load->fd->uri);
+		handle_put(load->curl_handle);
+		DEBUG("return: -1")
+		return -1;
+	}
+
+	curl_easy_getinfo(load->curl_handle, CURLINFO_STARTTRANSFER_TIME_T, &first);
+	curl_easy_getinfo(load->curl_handle, CURLINFO_TOTAL_TIME_T, &total);
+	load->latency = first / 1e6;
+	if(total > first)
+		load->rate = load->buffer.read / ((total - first) / 1e6);
+	handle_put(load->curl_handle);
+
+	DEBUG("return: %lu", load->buffer.read)
+	return load->buffer.read;
+}
+
+/* the bytes of block index of a file of size bytes */
+static size_t disk_block_bytes(int64_t size, off_t index)
+{
+	off_t offset = index * (off_t)block_size;
+	return size - offset < (off_t)block_size ? (size_t)(size - offset) : block_size;
+}
+
+static inline int disk_has(const disk_entry *entry, off_t index)
+{
+	return index < entry->nblocks && entry->bitmap[index / 8] & (1 << (index % 8));
+}
+
+/* the files of a uri are named after an FNV-1a hash of it and of what the manifest says
+ * about it, so a file that's changed in the manifest starts over */
+static void disk_key(const char *uri, int64_t size, int64_t mtime, char *name)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	uint64_t fields[3];
+	const unsigned char *p;
+	size_t i;
+
+	for(p = (const unsigned char *)uri; *p; p++)
+		hash = (hash ^ *p) * 1099511628211ULL;
+	fields[0] = size;
+	fields[1] = mtime;
+	fields[2] = block_size;
+	p = (const unsigned char *)fields;
+	for(i = 0; i < sizeof(fields); i++)
+		hash = (hash ^ p[i]) * 1099511628211ULL;
+	snprintf(name, 17, "%016llx", (unsigned long long)hash);
+}
+
+static char *disk_path(const char *name, const char *suffix)
+{
+	char *path;
+	if(asprintf(&path, "%s/%s.%s", disk_dir, name, suffix) == -1)
+		return NULL;
+	return path;
+}
+
+static disk_entry **disk_find(const char *name)
+{
+	disk_entry **p = &disk_table[strtoull(name, NULL, 16) % DISK_BUCKETS];
+	while(*p && strcmp((*p)->name, name) != 0)
+		p = &(*p)->next;
+	return p;
+}
+
+static void disk_unlink(const char *name)
+{
+	char *path;
+
+	if((path = disk_path(name, "data")))
+	{
+		unlink(path);
+		xfree(path);
+	}
+	if((path = disk_path(name, "map")))
+	{
+		unlink(path);
+		xfree(path);
+	}
+}
+
+/* drops the least recently used uris nobody has open until needed more bytes fit in
+ * disk_size, disk_lock must be held */
+static void disk_evict(size_t needed)
+{
+	while(disk_used + needed > disk_size)
+	{
+		disk_entry *oldest = NULL, *entry, **p;
+		size_t i;
+
+		for(i = 0; i < DISK_BUCKETS; i++)
+			for(entry = disk_table[i]; entry; entry = entry->next)
+				if(entry->refs == 0 && (!oldest || entry->used < oldest->used))
+					oldest = entry;
+		if(!oldest)
+			return;
+
+		DEBUG("evicting %s from the disk cache", oldest->name)
+		p = disk_find(oldest->name);
+		*p = oldest->next;
+		disk_used -= oldest->bytes;
+		disk_unlink(oldest->name);
+		xfree(oldest);
+	}
+}
+
+/* counts the bytes of the blocks in the bitmap */
+static size_t disk_count(const disk_entry *entry)
+{
+	size_t bytes = 0;
+	off_t index;
+
+	for(index = 0; index < entry->nblocks; index++)
+		if(disk_has(entry, index))
+			bytes += disk_block_bytes(entry->header.size, index);
+	return bytes;
+}
+
+/* the bytes of a map file with header, the bitmap ends it */
+static off_t disk_map_size(const disk_header *header)
+{
+	off_t nblocks = header->size / block_size + (header->size % block_size != 0);
+	return sizeof(disk_header) + header->uri_size + nblocks / 8 + 1;
+}
+
+/* reads the header of a map file, 0 if it's one of ours */
+static int disk_read_header(int map_fd, disk_header *header)
+{
+	if(pread(map_fd, header, sizeof(disk_header), 0) != sizeof(disk_header))
+		return -1;
+	if(header->magic != DISK_MAGIC || header->block_size != block_size || header->size < 0 || header->uri_size == 0)
+		return -1;
+	header->validator[VALIDATOR_SIZE-1] = '\0';
+	return 0;
+}
+
+/* picks up what earlier mounts left in disk_dir */
+static void disk_scan(void)
+{
+	DIR *dir = opendir(disk_dir);
+	struct dirent *ent;
+
+	if(!dir)
+		return;
+	pthread_mutex_lock(&disk_lock);
+	while((ent = readdir(dir)))
+	{
+		size_t len = strlen(ent->d_name);
+		disk_entry *entry;
+		char *path;
+		struct stat st;
+		int map_fd;
+
+		if(len != 20 || strcmp(ent->d_name + 16, ".map") != 0)
+			continue;
+		entry = (disk_entry*)calloc(1, sizeof(disk_entry));
+		if(!entry)
+			break;
+		memcpy(entry->name, ent->d_name, 16);
+		entry->data_fd = entry->map_fd = -1;
+
+		path = disk_path(entry->name, "map");
+		map_fd = path ? open(path, O_RDONLY) : -1;
+		xfree(path);
+		if(map_fd < 0 || fstat(map_fd, &st) != 0 || disk_read_header(map_fd, &entry->header) != 0
+			|| st.st_size != disk_map_size(&entry->header))
+		{
+			/* from another block size, broken or cut short */
+			if(map_fd >= 0)
+				close(map_fd);
+			disk_unlink(entry->name);
+			xfree(entry);
+			continue;
+		}
+		entry->nblocks = (entry->header.size + block_size - 1) / block_size;
+		entry->map_offset = sizeof(disk_header) + entry->header.uri_size;
+		entry->bitmap = (unsigned char*)calloc(entry->nblocks / 8 + 1, 1);
+		if(entry->bitmap)
+		{
+			if(pread(map_fd, entry->bitmap, entry->nblocks / 8 + 1, entry->map_offset) < 0)
+				memset(entry->bitmap, 0, entry->nblocks / 8 + 1);
+			entry->bytes = disk_count(entry);
+		}
+		xfree(entry->bitmap);
+		entry->bitmap = NULL;
+		close(map_fd);
+		entry->used = st.st_mtime;
+
+		entry->next = disk_table[strtoull(entry->name, NULL, 16) % DISK_BUCKETS];
+		disk_table[strtoull(entry->name, NULL, 16) % DISK_BUCKETS] = entry;
+		disk_used += entry->bytes;
+	}
+	closedir(dir);
+	disk_evict(0);
+	DEBUG("%lu bytes in the disk cache", disk_used)
+	pthread_mutex_unlock(&disk_lock);
+}
+
+/* opens the files of entry and loads its bitmap, they're made over when they don't belong
+ * to uri. the caller has to be the one loading entry, disk_lock must not be held */
+static int disk_load(disk_entry *entry, const char *uri, int64_t size, int64_t mtime)
+{
+	char *path;
+	char *stored = NULL;
+	uint32_t uri_size = strlen(uri) + 1;
+	size_t bitmap_size;
+	int valid;
+
+	path = disk_path(entry->name, "data");
+	entry->data_fd = path ? open(path, O_RDWR | O_CREAT, 0600) : -1;
+	xfree(path);
+	path = disk_path(entry->name, "map");
+	entry->map_fd = path ? open(path, O_RDWR | O_CREAT, 0600) : -1;
+	xfree(path);
+	if(entry->data_fd < 0 || entry->map_fd < 0)
+		return -1;
+
+	entry->nblocks = (size + block_size - 1) / block_size;
+	entry->map_offset = sizeof(disk_header) + uri_size;
+	bitmap_size = entry->nblocks / 8 + 1;
+	entry->bitmap = (unsigned char*)calloc(bitmap_size, 1);
+	stored = (char*)malloc(uri_size);
+	if(!entry->bitmap || !stored)
+	{
+		xfree(stored);
+		return -1;
+	}
+
+	valid = disk_read_header(entry->map_fd, &entry->header) == 0
+		&& entry->header.uri_size == uri_size && entry->header.size == size && entry->header.mtime == mtime
+		&& lseek(entry->map_fd, 0, SEEK_END) == disk_map_size(&entry->header)
+		&& pread(entry->map_fd, stored, uri_size, sizeof(disk_header)) == (ssize_t)uri_size
+		&& memcmp(stored, uri, uri_size) == 0
+		&& pread(entry->map_fd, entry->bitmap, bitmap_size, entry->map_offset) >= 0;
+	xfree(stored);
+
+	if(!valid)
+	{
+		DEBUG("starting %s over for %s", entry->name, uri)
+		memset(&entry->header, 0, sizeof(disk_header));
+		entry->header.magic = DISK_MAGIC;
+		entry->header.block_size = block_size;
+		entry->header.uri_size = uri_size;
+		entry->header.size = size;
+		entry->header.mtime = mtime;
+		memset(entry->bitmap, 0, bitmap_size);
+		if(ftruncate(entry->data_fd, 0) != 0 || ftruncate(entry->map_fd, 0) != 0
+			|| pwrite(entry->map_fd, &entry->header, sizeof(disk_header), 0) != sizeof(disk_header)
+			|| pwrite(entry->map_fd, uri, uri_size, sizeof(disk_header)) != (ssize_t)uri_size
+			|| pwrite(entry->map_fd, entry->bitmap, bitmap_size, entry->map_offset) != (ssize_t)bitmap_size)
+			return -1;
+	}
+	entry->bytes = disk_count(entry);
+	return 0;
+}
+
+static void disk_close_files(disk_entry *entry)
+{
+	if(entry->data_fd >= 0)
+		close(entry->data_fd);
+	if(entry->map_fd >= 0)
+		close(entry->map_fd);
+	entry->data_fd = entry->map_fd = -1;
+	xfree(entry->bitmap);
+	entry->bitmap = NULL;
+}
+
+/* the disk cache entry of an open file, NULL if it can't have one */
+static disk_entry *disk_open(const char *uri, int64_t size, int64_t mtime)
+{
+	DEBUG("args: const char *uri = \"%s\", int64_t size = %lld, int64_t mtime = %lld", uri, (long long)size, (long long)mtime)
+	char name[17];
+	disk_entry **p;
+	disk_entry *entry;
+
+	disk_key(uri, size, mtime, name);
+	pthread_mutex_lock(&disk_lock);
+	p = disk_find(name);
+	entry = *p;
+	if(!entry)
+	{
+		entry = (disk_entry*)calloc(1, sizeof(disk_entry));
+		if(!entry)
+		{
+			pthread_mutex_unlock(&disk_lock);
+			DEBUG("return: NULL")
+			return NULL;
+		}
+		memcpy(entry->name, name, sizeof(name));
+		entry->data_fd = entry->map_fd = -1;
+		*p = entry;
+	}
+	entry->refs++;
+
+	/* the files are opened and read without the lock, a ref keeps entry from being evicted */
+	if(entry->refs == 1)
+	{
+		size_t bytes = entry->bytes;
+		int failed;
+
+		entry->loading = 1;
+		pthread_mutex_unlock(&disk_lock);
+		failed = disk_load(entry, uri, size, mtime) != 0;
+		pthread_mutex_lock(&disk_lock);
+		entry->loading = 0;
+		disk_used -= bytes;
+		if(failed)
+		{
+			DEBUG("Can't open %s in %s", name, disk_dir)
+			disk_close_files(entry);
+			*disk_find(name) = entry->next;
+			disk_unlink(name);
+		}
+		else
+			disk_used += entry->bytes;
+		pthread_cond_broadcast(&disk_loaded);
+	}
+	else
+		while(entry->loading)
+			pthread_cond_wait(&disk_loaded, &disk_lock);
+
+	/* whoever loaded it failed and took it out of the table */
+	if(entry->data_fd < 0)
+	{
+		if(--entry->refs == 0)
+			xfree(entry);
+		pthread_mutex_unlock(&disk_lock);
+		DEBUG("return: NULL")
+		return NULL;
+	}
+	entry->used = time(NULL);
+	/* the map's mtime is when the uri was used last, for the next mount */
+	futimens(entry->map_fd, NULL);
+	pthread_mutex_unlock(&disk_lock);
+
+	DEBUG("return: %p", entry)
+	return entry;
+}
+
+static void disk_close(disk_entry *entry)
+{
+	pthread_mutex_lock(&disk_lock);
+	entry->refs--;
+	if(entry->refs == 0)
+	{
+		disk_close_files(entry);
+		disk_evict(0);
+	}
+	pthread_mutex_unlock(&disk_lock);
+}
+
+/* reads block index from the disk cache, -1 if it isn't there */
+static ssize_t disk_read(disk_entry *entry, off_t index, char *data, size_t bytes)
+{
+	unsigned generation;
+	ssize_t read = 0;
+	int fd;
+
+	pthread_mutex_lock(&disk_lock);
+	if(!disk_has(entry, index))
+	{
+		pthread_mutex_unlock(&disk_lock);
+		return -1;
+	}
+	generation = entry->generation;
+	fd = entry->data_fd;
+	pthread_mutex_unlock(&disk_lock);
+
+	while((size_t)read < bytes)
+	{
+		ssize_t got = pread(fd, data + read, bytes - read, index * (off_t)block_size + read);
+		if(got <= 0)
+			break;
+		read += got;
+	}
+
+	pthread_mutex_lock(&disk_lock);
+	if(generation != entry->generation)
+		read = -1;
+	pthread_mutex_unlock(&disk_lock);
+
+	DEBUG("block %lld of %s from the disk: %ld", (long long)index, entry->name, (long)read)
+	return (size_t)read == bytes ? read : -1;
+}
+
+/* keeps a fetched block. when the server identifies the file differently than it did for
+ * the blocks there already, they're from another version of it and get thrown away */
+static void disk_write(disk_entry *entry, off_t index, const char *data, size_t bytes, const char *validator)
+{
+	unsigned generation;
+	off_t byte = index / 8;
+
+	pthread_mutex_lock(&disk_lock);
+	if(index >= entry->nblocks || disk_has(entry, index))
+	{
+		pthread_mutex_unlock(&disk_lock);
+		return;
+	}
+	if(*validator && strcmp(validator, entry->header.validator) != 0)
+	{
+		if(*entry->header.validator)
+		{
+			DEBUG("%s changed from %s to %s", entry->name, entry->header.validator, validator)
+			memset(entry->bitmap, 0, entry->nblocks / 8 + 1);
+			if(ftruncate(entry->data_fd, 0) != 0
+				|| pwrite(entry->map_fd, entry->bitmap, entry->nblocks / 8 + 1, entry->map_offset) < 0)
+				DEBUG("Can't clear %s", entry->name)
+			disk_used -= entry->bytes;
+			entry->bytes = 0;
+			entry->generation++;
+		}
+		snprintf(entry->header.validator, VALIDATOR_SIZE, "%s", validator);
+		if(pwrite(entry->map_fd, &entry->header, sizeof(disk_header), 0) != sizeof(disk_header))
+			DEBUG("Can't write the header of %s", entry->name)
+	}
+	disk_evict(bytes);
+	if(disk_used + bytes > disk_size)
+	{
+		pthread_mutex_unlock(&disk_lock);
+		return;
+	}
+	/* claimed, so the space isn't handed out twice */
+	disk_used += bytes;
+	generation = entry->generation;
+	pthread_mutex_unlock(&disk_lock);
+
+	if(pwrite(entry->data_fd, data, bytes, index * (off_t)block_size) != (ssize_t)bytes)
+	{
+		pthread_mutex_lock(&disk_lock);
+		disk_used -= bytes;
+		pthread_mutex_unlock(&disk_lock);
+		return;
+	}
+
+	pthread_mutex_lock(&disk_lock);
+	if(generation != entry->generation || disk_has(entry, index))
+		disk_used -= bytes;
+	else
+	{
+		/* the data goes first, a block is only marked once it's all there */
+		entry->bitmap[byte] |= 1 << (index % 8);
+		if(pwrite(entry->map_fd, &entry->bitmap[byte], 1, entry->map_offset + byte) != 1)
+			DEBUG("Can't mark block %lld of %s", (long long)index, entry->name)
+		entry->bytes += bytes;
+	}
+	pthread_mutex_unlock(&disk_lock);
+}
+
+static void disk_cleanup(void)
+{
+	size_t i;
+
+	if(!disk_table)
+		return;
+	for(i = 0; i < DISK_BUCKETS; i++)
+	{
+		while(disk_table[i])
+		{
+			disk_entry *entry = disk_table[i];
+			disk_table[i] = entry->next;
+			disk_close_files(entry);
+			xfree(entry);
+		}
+	}
+	xfree(disk_table);
+}
+
+static size_t cache_hash(const char *uri, off_t index)
+{
+	size_t hash = 5381;
+	while(*uri)
+		hash = hash*33 + (unsigned char)*uri++;
+	return (hash ^ ((size_t)index * 2654435761u)) % cache_buckets;
+}
+
+static void cache_free(cache_block *block)
+{
+	xfree(block->data);
+	xfree(block->uri);
+	xfree(block);
+}
+
+/* takes a block out of the hash table and the clock, cache_lock must be held */
+static void cache_unlink(cache_block *block)
+{
+	cache_block **p = &cache_table[cache_hash(block->uri, block->index)];
+	while(*p != block)
+		p = &(*p)->hash_next;
+	*p = block->hash_next;
+
+	if(block->clock_next == block)
+		cache_hand = NULL;
+	else
+	{
+		block->clock_prev->clock_next = block->clock_next;
+		block->clock_next->clock_prev = block->clock_prev;
+		if(cache_hand == block)
+			cache_hand = block->clock_next;
+	}
+	cache_used -= block_size;
+	block->linked = 0;
+}
+
+/* CLOCK eviction until needed more bytes fit in cache_size, cache_lock must be held.
+ * blocks in use are skipped, after two turns the cache is allowed to go over budget */
+static void cache_evict(size_t needed)
+{
+	size_t steps = 2 * (cache_used / block_size);
+	while(cache_hand && cache_used + needed > cache_size && steps-- > 0)
+	{
+		cache_block *block = cache_hand;
+		cache_hand = block->clock_next;
+		if(block->refs > 0)
+			continue;
+		if(block->referenced)
+		{
+			block->referenced = 0;
+			continue;
+		}
+		DEBUG("evicting block %lld of %s", (long long)block->index, block->uri)
+		cache_unlink(block);
+		cache_free(block);
+	}
+}
+
+static void cache_put_locked(cache_block *block)
+{
+	block->refs--;
+	if(block->refs > 0)
+		return;
+	if(!block->linked)
+		cache_free(block);
+	else
+		cache_evict(0);
+}
+
+/* block index of uri, cache_lock must be held */
+static cache_block *cache_find(const char *uri, off_t index)
+{
+	cache_block *block;
+	for(block = cache_table[cache_hash(uri, index)]; block; block = block->hash_next)
+		if(block->index == index && strcmp(block->uri, uri) == 0)
+			break;
+	return block;
+}
+
+/* adds block index of fd->uri as loading, the caller has to cache_load() it and give it
+ * back. cache_lock must be held */
+static cache_block *cache_claim(uri_fd *fd, off_t index)
+{
+	size_t hash = cache_hash(fd->uri, index);
+	cache_block *block;
+
+	cache_evict(block_size);
+	block = (cache_block*)calloc(1, sizeof(cache_block));
+	if(block)
+	{
+		block->uri = strdup(fd->uri);
+		block->data = (char*)malloc(block_size);
+	}
+	if(!block || !block->uri || !block->data)
+	{
+		if(block)
+			cache_free(block);
+		return NULL;
+	}
+	block->index = index;
+	block->state = BLOCK_LOADING;
+	block->refs = 1;
+	block->linked = 1;
+	block->hash_next = cache_table[hash];
+	cache_table[hash] = block;
+	if(cache_hand)
+	{
+		/* behind the hand, so it's looked at last */
+		block->clock_next = cache_hand;
+		block->clock_prev = cache_hand->clock_prev;
+		cache_hand->clock_prev->clock_next = block;
+		cache_hand->clock_prev = block;
+	}
+	else
+		cache_hand = block->clock_next = block->clock_prev = block;
+	cache_used += block_size;
+	return block;
+}
+
+/* loads count claimed blocks, sorted by index, from the disk cache or the server. runs of
+ * consecutive blocks are split into ranges that are fetched at the same time, about one for
+ * each of parallel connections, but none shorter than what a connection moves while it
+ * waits for the first byte of the next. the blocks end up ready or failed */
+static void cache_load(uri_fd *fd, cache_block **blocks, int count)
+{
+	DEBUG("args: uri_fd *fd = %p, cache_block **blocks = %p, int count = %d", fd, blocks, count)
+	ssize_t got[MAX_LOAD];
+	range_fetch loads[MAX_LOAD];
+	int starts[MAX_LOAD], ends[MAX_LOAD];
+	int nloads = 0, missing = 0, chunk, i, j, l;
+
+	for(i = 0; i < count; i++)
+	{
+		got[i] = -1;
+		if(fd->disk)
+			got[i] = disk_read(fd->disk, blocks[i]->index, blocks[i]->data, disk_block_bytes(fd->size, blocks[i]->index));
+		if(got[i] < 0)
+			missing++;
+	}
+
+	pthread_mutex_lock(&cache_lock);
+	chunk = fetch_rate * fetch_latency / block_size + 1;
+	pthread_mutex_unlock(&cache_lock);
+	if(chunk < (missing + parallel - 1) / parallel)
+		chunk = (missing + parallel - 1) / parallel;
+
+	for(i = 0; i < count; i = j)
+	{
+		size_t bytes;
+
+		j = i + 1;
+		if(got[i] >= 0)
+			continue;
+		bytes = disk_block_bytes(fd->size, blocks[i]->index);
+		for(; j < count && j - i < chunk && got[j] < 0 && blocks[j]->index == blocks[j-1]->index + 1; j++)
+			bytes += disk_block_bytes(fd->size, blocks[j]->index);
+		starts[nloads] = i;
+		ends[nloads] = j;
+		if(range_start(&loads[nloads], fd, blocks + i, blocks[i]->index * (off_t)block_size, bytes) == 0)
+			nloads++;
+	}
+	DEBUG("%d of %d blocks in %d ranges of up to %d blocks", missing, count, nloads, chunk)
+
+	for(l = 0; l < nloads; l++)
+	{
+		ssize_t read = range_finish(&loads[l]);
+		if(read < 0)
+			continue;
+		for(i = starts[l]; i < ends[l]; i++)
+		{
+			ssize_t skip = (i - starts[l]) * (ssize_t)block_size;
+			size_t bytes = disk_block_bytes(fd->size, blocks[i]->index);
+
+			got[i] = read - skip < 0 ? 0 : read - skip < (ssize_t)bytes ? read - skip : (ssize_t)bytes;
+			if(fd->disk && got[i] == (ssize_t)bytes)
+				disk_write(fd->disk, blocks[i]->index, blocks[i]->data, bytes, loads[l].validator);
+		}
+	}
+
+	pthread_mutex_lock(&cache_lock);
+	for(l = 0; l < nloads; l++)
+	{
+		if(loads[l].rate <= 0)
+			continue;
+		fetch_rate = fetch_rate > 0 ? fetch_rate * 0.75 + loads[l].rate * 0.25 : loads[l].rate;
+		fetch_latency = fetch_latency > 0 ? fetch_latency * 0.75 + loads[l].latency * 0.25 : loads[l].latency;
+	}
+	for(i = 0; i < count; i++)
+	{
+		if(got[i] < 0)
+		{
+			blocks[i]->state = BLOCK_FAILED;
+			if(blocks[i]->linked)
+				cache_unlink(blocks[i]);
+		}
+		else
+		{
+			blocks[i]->size = got[i];
+			blocks[i]->state = BLOCK_READY;
+		}
+	}
+	pthread_cond_broadcast(&cache_loaded);
+	pthread_mutex_unlock(&cache_lock);
+}
+
+/* loads the blocks from first to last of fd->uri that aren't cached or on their way yet,
+ * all at once */
+static void cache_fetch(uri_fd *fd, off_t first, off_t last)
+{
+	DEBUG("args: uri_fd *fd = %p, off_t first = %lld, off_t last = %lld", fd, (long long)first, (long long)last)
+	cache_block *blocks[MAX_LOAD];
+	int count, i;
+
+	while(first <= last)
+	{
+		count = 0;
+		pthread_mutex_lock(&cache_lock);
+		for(; first <= last && count < MAX_LOAD; first++)
+			if(!cache_find(fd->uri, first) && (blocks[count] = cache_claim(fd, first)))
+				count++;
+		pthread_mutex_unlock(&cache_lock);
+		if(count == 0)
+			continue;
+
+		cache_load(fd, blocks, count);
+
+		pthread_mutex_lock(&cache_lock);
+		for(i = 0; i < count; i++)
+			cache_put_locked(blocks[i]);
+		pthread_mutex_unlock(&cache_lock);
+	}
+}
+
+/* copies bytes at offset of fd->uri into buf. the blocks stay pinned from the lookup until
+ * they are copied, missing ones are loaded all at once and the ones someone else is loading
+ * are waited for. returns how many bytes were copied, less when the server sent less, or -1
+ * when the first block failed */
+static ssize_t cache_read(uri_fd *fd, char *buf, off_t offset, size_t bytes)
+{
+	DEBUG("args: uri_fd *fd = %p, char *buf = %p, off_t offset = %lld, size_t bytes = %lu", fd, buf, (long long)offset, bytes)
+	cache_block *blocks[MAX_LOAD], *claimed[MAX_LOAD];
+	off_t index, last = (offset + (off_t)bytes - 1) / (off_t)block_size;
+	size_t done = 0;
+	int count, nclaimed, stop = 0, failed = 0, i;
+
+	while(done < bytes && !stop)
+	{
+		count = nclaimed = 0;
+		pthread_mutex_lock(&cache_lock);
+		for(index = (offset + (off_t)done) / (off_t)block_size; index <= last && count < MAX_LOAD; index++)
+		{
+			cache_block *block = cache_find(fd->uri, index);
+			if(block)
+			{
+				block->refs++;
+				block->referenced = 1;
+			}
+			else if((block = cache_claim(fd, index)))
+				claimed[nclaimed++] = block;
+			else
+				break;
+			blocks[count++] = block;
+		}
+		pthread_mutex_unlock(&cache_lock);
+
+		if(nclaimed > 0)
+			cache_load(fd, claimed, nclaimed);
+
+		pthread_mutex_lock(&cache_lock);
+		for(i = 0; i < count; i++)
+			while(blocks[i]->state == BLOCK_LOADING)
+				pthread_cond_wait(&cache_loaded, &cache_lock);
+		pthread_mutex_unlock(&cache_lock);
+
+		/* pinned and no longer loading, the data can't change under us */
+		stop = count == 0;
+		for(i = 0; i < count && !stop; i++)
+		{
+			size_t start = offset + (off_t)done - blocks[i]->index * (off_t)block_size;
+			size_t len;
+
+			/* the server sent less than asked for */
+			if(blocks[i]->state == BLOCK_FAILED || start >= blocks[i]->size)
+			{
+				stop = 1;
+				break;
+			}
+			len = blocks[i]->size - start;
+			if(len > bytes - done)
+				len = bytes - done;
+			memcpy(buf + done, blocks[i]->data + start, len);
+			done += len;
+			stop = blocks[i]->size < block_size;
+		}
+		failed = done == 0 && (count == 0 || blocks[0]->state == BLOCK_FAILED);
+
+		pthread_mutex_lock(&cache_lock);
+		for(i = 0; i < count; i++)
+			cache_put_locked(blocks[i]);
+		pthread_mutex_unlock(&cache_lock);
+	}
+
+	if(failed)
+	{
+		DEBUG("return: -1")
+		return -1;
+	}
+	DEBUG("return: %lu", done)
+	return done;
+}
+
+static int cache_compare_uri(const void *a, const void *b)
+{
+	return strcmp(*(const char * const *)a, *(const char * const *)b);
+}
+
+/* drops the blocks of the count uris, sorted with strcmp, or all of them when uris is NULL.
+ * blocks someone is using are only taken out of the cache, they go once they're given back */
+static void cache_invalidate(const char **uris, size_t count)
+{
+	size_t i;
+
+	if(uris && count == 0)
+		return;
+	pthread_mutex_lock(&cache_lock);
+	for(i = 0; i < cache_buckets; i++)
+	{
+		cache_block *block = cache_table[i];
+		while(block)
+		{
+			cache_block *next = block->hash_next;
+			if(!uris || bsearch(&block->uri, uris, count, sizeof(char*), cache_compare_uri))
+			{
+				DEBUG("dropping block %lld of %s", (long long)block->index, block->uri)
+				cache_unlink(block);
+				if(block->refs == 0)
+					cache_free(block);
+			}
+			block = next;
+		}
+	}
+	pthread_mutex_unlock(&cache_lock);
+}
+
+static void uri_fd_free(uri_fd *fd)
+{
+	if(fd->disk)
+		disk_close(fd->disk);
+	curl_slist_free_all(fd->header);
+	xfree(fd->uri);
+	xfree(fd);
+}
+
+/* drops a reference to an open file, the last one frees it */
+static void uri_fd_put(uri_fd *fd)
+{
+	int refs;
+
+	pthread_mutex_lock(&prefetch_lock);
+	refs = --fd->refs;
+	pthread_mutex_unlock(&prefetch_lock);
+	if(refs == 0)
+		uri_fd_free(fd);
+}
+
+/* the slot of handle index, NULL if it was never handed out */
+static file_slot *file_slot_of(uint32_t index)
+{
+	file_slot *chunk;
+
+	if(index >= __atomic_load_n(&file_slots, __ATOMIC_ACQUIRE))
+		return NULL;
+	chunk = __atomic_load_n(&file_chunks[index / FILE_CHUNK], __ATOMIC_ACQUIRE);
+	return chunk ? &chunk[index % FILE_CHUNK] : NULL;
+}
+
+/* a slot nobody uses, from the free list or a new one at the end of the table */
+static file_slot *file_slot_new(uint32_t *index)
+{
+	uint64_t head = __atomic_load_n(&file_free, __ATOMIC_ACQUIRE);
+	file_slot *chunk, *fresh;
+	uint32_t slots;
+
+	while((uint32_t)head != FILE_NONE)
+	{
+		file_slot *slot = file_slot_of((uint32_t)head);
+		uint64_t next = ((head >> 32) + 1) << 32 | __atomic_load_n(&slot->next, __ATOMIC_RELAXED);
+		if(__atomic_compare_exchange_n(&file_free, &head, next, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		{
+			*index = (uint32_t)head;
+			return slot;
+		}
+	}
+
+	slots = __atomic_load_n(&file_slots, __ATOMIC_RELAXED);
+	do {
+		if(slots >= FILE_CHUNK * FILE_CHUNKS)
+			return NULL;
+		chunk = __atomic_load_n(&file_chunks[slots / FILE_CHUNK], __ATOMIC_ACQUIRE);
+		if(!chunk)
+		{
+			/* whoever comes first puts the chunk in, it's never moved or freed until
+			 * the unmount */
+			fresh = (file_slot*)calloc(FILE_CHUNK, sizeof(file_slot));
+			if(!fresh)
+				return NULL;
+			if(__atomic_compare_exchange_n(&file_chunks[slots / FILE_CHUNK], &chunk, fresh, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+				chunk = fresh;
+			else
+				xfree(fresh);
+		}
+	} while(!__atomic_compare_exchange_n(&file_slots, &slots, slots + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+	*index = slots;
+	return &chunk[slots % FILE_CHUNK];
+}
+
+/* puts fd in the table, the handle is the slot and its generation, -1 if the table's full */
+static int file_add(uri_fd *fd, uint64_t *handle)
+{
+	uint32_t index;
+	file_slot *slot = file_slot_new(&index);
+
+	if(!slot)
+		return -1;
+	__atomic_store_n(&slot->fd, fd, __ATOMIC_RELEASE);
+	*handle = (uint64_t)__atomic_load_n(&slot->generation, __ATOMIC_ACQUIRE) << 32 | index;
+	return 0;
 }
 
+/* the file of handle, NULL if it's been released */
+static uri_fd *file_get(uint64_t handle)
+{
+	file_slot *slot = file_slot_of((uint32_t)handle);
+
+	if(!slot || __atomic_load_n(&slot->generation, __ATOMIC_ACQUIRE) != (uint32_t)(handle >> 32))
+		return NULL;
+	return __atomic_load_n(&slot->fd, __ATOMIC_ACQUIRE);
+}
 
-static char *xpath_from_path(const char *path)
+/* takes the file of handle out of the table, NULL if it's been released already. the slot
+ * gets a new generation, so the old handle is no good anymore */
+static uri_fd *file_remove(uint64_t handle)
 {
-	char *p;
-	char *xpath = NULL;
-	size_t len = strlen(path);
-	char *tmp = (char*)malloc(len+1);
-	if (!tmp)
+	file_slot *slot = file_slot_of((uint32_t)handle);
+	uint32_t generation = (uint32_t)(handle >> 32);
+	uint64_t head, next;
+	uri_fd *fd;
+
+	if(!slot || !__atomic_compare_exchange_n(&slot->generation, &generation, generation + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
 		return NULL;
-	strncpy(tmp, path, len+1);
-	if (asprintf(&xpath, "/root") == -1)
+	fd = __atomic_exchange_n(&slot->fd, NULL, __ATOMIC_ACQ_REL);
+
+	head = __atomic_load_n(&file_free, __ATOMIC_ACQUIRE);
+	do {
+		__atomic_store_n(&slot->next, (uint32_t)head, __ATOMIC_RELAXED);
+		next = ((head >> 32) + 1) << 32 | (uint32_t)handle;
+	} while(!__atomic_compare_exchange_n(&file_free, &head, next, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+	return fd;
+}
+
+/* called with the blocks a read touches. reads that stay in the last block or go on with
+ * the next one are sequential, then the window doubles each time the reader gets to a new
+ * block, up to readahead_size. the blocks in the window after the read that aren't queued
+ * yet go to the prefetch threads as one job. anything else closes the window */
+static void read_ahead(uri_fd *fd, off_t first, off_t last)
+{
+	size_t max = readahead_size / block_size;
+	off_t end = (fd->size + block_size - 1) / block_size;
+	off_t target;
+	prefetch_job *job;
+
+	/* leave room in the cache for the reader */
+	if(max > cache_size / block_size / 2)
+		max = cache_size / block_size / 2;
+
+	pthread_mutex_lock(&prefetch_lock);
+	if(first == fd->last_block || first == fd->last_block + 1)
 	{
-		xfree(tmp);
-		return NULL;
+		if(last > fd->last_block)
+			fd->window = fd->window ? fd->window * 2 : 1;
+		if(fd->window > max)
+			fd->window = max;
+	}
+	else
+	{
+		fd->window = 0;
+		fd->ahead = 0;
 	}
-	p = strtok(tmp, "/");
-	while( p != NULL )
+	fd->last_block = last;
+
+	if(fd->ahead <= last)
+		fd->ahead = last + 1;
+	target = last + 1 + (off_t)fd->window;
+	if(target > end)
+		target = end;
+	if(fd->ahead < target && (job = (prefetch_job*)malloc(sizeof(prefetch_job))))
 	{
-		char *new;
-		if (asprintf(&new, "%s/""*[@name=\"%s\"]", xpath, p) == -1)
-		{
-			xfree(xpath);
-			xfree(tmp);
-			return NULL;
-		}
-		xfree(xpath);
-		xpath = new;
-		p = strtok(NULL, "/");
+		job->fd = fd;
+		job->index = fd->ahead;
+		job->count = target - fd->ahead;
+		job->next = NULL;
+		fd->refs++;
+		if(prefetch_tail)
+			prefetch_tail->next = job;
+		else
+			prefetch_head = job;
+		prefetch_tail = job;
+		fd->ahead = target;
+		DEBUG("queued %lld blocks after block %lld of %s", (long long)job->count, (long long)last, fd->uri)
+		pthread_cond_signal(&prefetch_queued);
 	}
-	xfree(tmp);
-	return xpath;
+	pthread_mutex_unlock(&prefetch_lock);
 }
 
-struct curl_buffer {
-	char *data;
-	size_t size;
-	size_t read;
-};
-
-static size_t curl_get_callback(void *contents, size_t size, size_t nmemb, void *userp)
+static void *prefetch_thread(void *arg)
 {
-	DEBUG("args: void *contents = %p, size_t size = %lu, size_t nmemb = %lu, void *userp = %p", contents, size, nmemb, userp)
-	size_t realsize = size * nmemb;
-	struct curl_buffer *buffer = (struct curl_buffer *)userp;
-	if(buffer->read + realsize > buffer->size)
-		realsize = buffer->size - buffer->read;
+	(void)arg;
+	prefetch_job *job;
+	int closed;
+
+	pthread_mutex_lock(&prefetch_lock);
+	while(1)
+	{
+		while(!prefetch_head && !prefetch_stop)
+			pthread_cond_wait(&prefetch_queued, &prefetch_lock);
+		if(prefetch_stop)
+			break;
 
-	memcpy(buffer->data+buffer->read, contents, realsize);
-	buffer->read += realsize;
+		job = prefetch_head;
+		prefetch_head = job->next;
+		if(!prefetch_head)
+			prefetch_tail = NULL;
+		closed = job->fd->closed;
+		pthread_mutex_unlock(&prefetch_lock);
 
-	DEBUG("return: %lu", realsize)
-	return realsize;
+		/* nobody is going to read it anymore */
+		if(!closed)
+			cache_fetch(job->fd, job->index, job->index + job->count - 1);
+		uri_fd_put(job->fd);
+		xfree(job);
+
+		pthread_mutex_lock(&prefetch_lock);
+	}
+	pthread_mutex_unlock(&prefetch_lock);
+	return NULL;
 }
 
-static void header_cmd(uri_fd *fd, const char *cmd)
+/* the manifest for a getattr, readdir or open, give it back with index_leave(). it stays
+ * valid until then even when a new one is swapped in, see index_swap() */
+static uri_index *index_enter(unsigned *epoch)
 {
-	DEBUG("args: uri_fd *fd = %p, const char *cmd = \"%s\"", fd, cmd)
-	FILE *fp = popen(cmd, "r");
-	char *line = NULL;
-	size_t len = 0;
-	ssize_t read;
-
-	if (fp != NULL)
+	while(1)
 	{
-		while ((read = getline(&line, &len, fp)) > 0 && line)
+		unsigned e = __atomic_load_n(&index_epoch, __ATOMIC_SEQ_CST);
+		__atomic_add_fetch(&index_readers[e & 1], 1, __ATOMIC_SEQ_CST);
+		if(__atomic_load_n(&index_epoch, __ATOMIC_SEQ_CST) == e)
 		{
-			line[read-1] = '\0';
-			fd->header = curl_slist_append(fd->header,line);
-			DEBUG("Added header \"%s\"", line)
+			*epoch = e;
+			return __atomic_load_n(&current_index, __ATOMIC_SEQ_CST);
 		}
-		xfree(line);
-		pclose(fp);
+		/* a swap came in between, count on the other side */
+		__atomic_sub_fetch(&index_readers[e & 1], 1, __ATOMIC_SEQ_CST);
 	}
 }
 
-static int urifs_getattr(const char *path, struct stat *stbuf)
+static void index_leave(unsigned epoch)
 {
-	DEBUG("args: const char *path = \"%s\", struct stat *stbuf = %p", path, stbuf)
-	xmlChar *value;
-	xmlNodeSetPtr nodes;
-	xmlNodePtr node;
-	xmlXPathObjectPtr xpathObj;
+	__atomic_sub_fetch(&index_readers[epoch & 1], 1, __ATOMIC_RELEASE);
+}
 
-	char *xpath = xpath_from_path(path);
-	if (!xpath)
-	{
-		DEBUG("return: -ENOENT(%d)", -ENOENT)
-		return -ENOENT;
-	}
+/* puts index in place of the current manifest and returns the old one once nobody can be
+ * using it anymore. readers that came before the epoch moved on are counted on the old
+ * side, those after it see the new manifest. only the watch thread calls it */
+static uri_index *index_swap(uri_index *index)
+{
+	uri_index *old = __atomic_exchange_n(&current_index, index, __ATOMIC_SEQ_CST);
+	unsigned e = __atomic_load_n(&index_epoch, __ATOMIC_SEQ_CST);
 
-	DEBUG("xpath: %s", xpath);
+	__atomic_store_n(&index_epoch, e + 1, __ATOMIC_SEQ_CST);
+	while(__atomic_load_n(&index_readers[e & 1], __ATOMIC_ACQUIRE) > 0)
+		usleep(1000);
+	return old;
+}
+
+static int index_compare_uri(const void *a, const void *b, void *arg)
+{
+	const uri_index *index = arg;
+	return strcmp(index_string(index, (*(const uri_node * const *)a)->uri), index_string(index, (*(const uri_node * const *)b)->uri));
+}
 
-	xpathObj = xmlXPathEvalExpression((xmlChar*)xpath, fuse_get_context()->private_data);
-	xfree(xpath);
-	if(xpathObj == NULL)
+/* the uris of the files in old that aren't in new with the same size and mtime, so their
+ * cached blocks may be from something else now. NULL on errors */
+static const char **index_changed(const uri_index *old, const uri_index *new, size_t *count)
+{
+	const uri_node **files = (const uri_node**)malloc((new->count + 1) * sizeof(uri_node*));
+	const char **changed = (const char**)malloc((old->count + 1) * sizeof(char*));
+	size_t nfiles = 0;
+	uint32_t i;
+
+	*count = 0;
+	if(!files || !changed)
 	{
-		DEBUG("return: -ENOENT(%d)", -ENOENT)
-		return -ENOENT;
+		xfree(files);
+		xfree(changed);
+		return NULL;
 	}
 
-	nodes = xpathObj->nodesetval;
+	for(i = 0; i < new->count; i++)
+		if(new->nodes[i].flags & NODE_SIZE && index_string(new, new->nodes[i].uri))
+			files[nfiles++] = &new->nodes[i];
+	qsort_r(files, nfiles, sizeof(uri_node*), index_compare_uri, (void *)new);
 
-	if (nodes && nodes->nodeNr > 0)
+	for(i = 0; i < old->count; i++)
 	{
-		DEBUG("%d nodes found", nodes->nodeNr)
-		node = nodes->nodeTab[0];
-
-		if(strcmp((char*)node->name, "dir")==0 || strcmp((char*)node->name, "root")==0)
-		{
-			DEBUG("dir")
-			stbuf->st_mode = S_IFDIR | S_IXUSR | S_IXGRP | S_IXOTH;
-		}
-		else
+		const uri_node *node = &old->nodes[i];
+		const char *uri = index_string(old, node->uri);
+		size_t first = 0, end = nfiles;
+		int same = 0;
+
+		if(!(node->flags & NODE_SIZE) || !uri)
+			continue;
+		while(first < end)
 		{
-			DEBUG("file")
-			stbuf->st_mode = S_IFREG;
+			size_t middle = first + (end - first) / 2;
+			if(strcmp(index_string(new, files[middle]->uri), uri) < 0)
+				first = middle + 1;
+			else
+				end = middle;
 		}
+		for(; first < nfiles && strcmp(index_string(new, files[first]->uri), uri) == 0 && !same; first++)
+			same = files[first]->size == node->size && files[first]->mtime == node->mtime;
+		if(!same)
+			changed[(*count)++] = uri;
+	}
+	xfree(files);
 
-		stbuf->st_ino = 0;
-		stbuf->st_mode |= S_IRUSR | S_IRGRP | S_IROTH /*| S_IWUSR | S_IWGRP | S_IWOTH*/;
-		stbuf->st_nlink = 0;
-		stbuf->st_uid = 0;
-		stbuf->st_gid = 0;
-		stbuf->st_rdev = 0;
-		stbuf->st_size = 1;
-		stbuf->st_blksize = 1;
-		stbuf->st_blocks = 1;
-		stbuf->st_atime = 0;
-		stbuf->st_mtime = 0;
-		stbuf->st_ctime = 0;
-
-		value = xmlGetProp(node, (xmlChar*)"size");
-		if(value)
-		{
-			stbuf->st_blocks = stbuf->st_size = atoll((char*)value);
-			xmlFree(value);
-		}
+	qsort(changed, *count, sizeof(char*), cache_compare_uri);
+	return changed;
+}
 
-		value = xmlGetProp(node, (xmlChar*)"uid");
-		if(value)
-		{
-			stbuf->st_blocks = stbuf->st_size = atoll((char*)value);
-			xmlFree(value);
-		}
+/* loads the manifest again and swaps it in, the current one stays if it can't be read */
+static void manifest_reload(void)
+{
+	DEBUG("args: none")
+	uri_index *index = index_load(source_xml);
+	uri_index *old;
+	const char **changed;
+	size_t count = 0;
 
-		value = xmlGetProp(node, (xmlChar*)"gid");
-		if(value)
-		{
-			stbuf->st_uid = atoi((char*)value);
-			xmlFree(value);
-		}
+	if(!index)
+	{
+		DEBUG("Can't load %s, keeping the manifest", source_xml)
+		return;
+	}
 
-		value = xmlGetProp(node, (xmlChar*)"mode");
-		if(value)
-		{
-			stbuf->st_mode &= S_IFMT;
-			stbuf->st_mode |= strtol ((char*)value, NULL, 8);
-			xmlFree(value);
-		}
+	old = index_swap(index);
+	changed = index_changed(old, index, &count);
+	/* without the list nothing is kept, whatever changed */
+	cache_invalidate(changed, count);
+	DEBUG("reloaded %s, %lu files changed", source_xml, count)
+	xfree(changed);
+	index_free(old);
+}
 
-		value = xmlGetProp(node, (xmlChar*)"ctime");
-		if(value)
-		{
-			stbuf->st_ctime = atoi((char*)value);
-			xmlFree(value);
-		}
+/* waits for the manifest to be written or replaced, then reloads it once it's been quiet
+ * for a moment. it watches the directory, so a new file renamed over the manifest counts.
+ * a compiled manifest is only reloaded then, one that's written to could be half done */
+static void *manifest_thread(void *arg)
+{
+	(void)arg;
+	char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const char *name = strrchr(source_xml, '/') ? strrchr(source_xml, '/') + 1 : source_xml;
+	struct pollfd fds[2];
+	int pending = 0;
+
+	fds[0].fd = manifest_inotify;
+	fds[0].events = POLLIN;
+	fds[1].fd = manifest_pipe[0];
+	fds[1].events = POLLIN;
+	while(1)
+	{
+		int ready = poll(fds, 2, pending ? 200 : -1);
+		ssize_t len;
+		char *p;
 
-		value = xmlGetProp(node, (xmlChar*)"atime");
-		if(value)
+		if(ready < 0 && errno != EINTR)
+			break;
+		if(fds[1].revents)
+			break;
+		if(ready == 0)
 		{
-			stbuf->st_atime = atoi((char*)value);
-			xmlFree(value);
+			pending = 0;
+			manifest_reload();
+			continue;
 		}
+		if(ready < 0 || !(fds[0].revents & POLLIN))
+			continue;
 
-		value = xmlGetProp(node, (xmlChar*)"mtime");
-		if(value)
+		len = read(manifest_inotify, events, sizeof(events));
+		for(p = events; len > 0 && p < events + len; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len)
 		{
-			stbuf->st_mtime = atoi((char*)value);
-			xmlFree(value);
+			struct inotify_event *event = (struct inotify_event *)p;
+			/* current_index only changes on this thread */
+			if(event->len && strcmp(event->name, name) == 0 && (!current_index->compiled || event->mask & IN_MOVED_TO))
+				pending = 1;
 		}
-		DEBUG("mode: %d", stbuf->st_mode)
-
-		xmlXPathFreeObject(xpathObj);
-		DEBUG("return: 0")
-		return 0;
 	}
-	else
-		DEBUG("Invalid Xpath")
-
-	xmlXPathFreeObject(xpathObj);
-
-	DEBUG("return: -ENOENT(%d)", -ENOENT)
-	return -ENOENT;
+	return NULL;
 }
 
-static int urifs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
+static void manifest_watch(void)
 {
-	(void)offset;
-	(void)fi;
-	DEBUG("args: const char *path = \"%s\", void *buf = %p, fuse_fill_dir_t filler = %p, off_t offset = %lu, int fi->fh = %lu", path, buf, filler, offset, fi->fh)
-	int i;
-	int nb;
-	char *xpath;
-	xmlChar *value;
-	xmlNodeSetPtr nodes;
-	xmlXPathObjectPtr xpathObj;
+	char *dir = strdup(source_xml);
+	char *slash = dir ? strrchr(dir, '/') : NULL;
 
-	char *tmp = xpath_from_path(path);
-	if (!tmp)
+	if(!slash)
 	{
-		DEBUG("return: -ENOENT(%d)", -ENOENT)
-		return -ENOENT;
+		xfree(dir);
+		return;
 	}
-
-	if (asprintf(&xpath, "%s/*[@name]", tmp) == -1)
+	*slash = '\0';
+	manifest_inotify = inotify_init1(IN_CLOEXEC);
+	if(manifest_inotify < 0 || inotify_add_watch(manifest_inotify, *dir ? dir : "/", IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0
+		|| pipe(manifest_pipe) != 0 || pthread_create(&manifest_tid, NULL, manifest_thread, NULL) != 0)
 	{
-		xfree(tmp);
-		DEBUG("return: -ENOENT(%d)", -ENOENT)
-		return -ENOENT;
+		DEBUG("Can't watch %s, it won't be reloaded", source_xml)
+		if(manifest_inotify >= 0)
+			close(manifest_inotify);
+		manifest_inotify = -1;
 	}
-	xfree(tmp);
+	xfree(dir);
+}
+
+static void manifest_unwatch(void)
+{
+	if(manifest_inotify < 0)
+		return;
+	if(write(manifest_pipe[1], "", 1) != 1)
+		DEBUG("Can't stop the watch thread")
+	pthread_join(manifest_tid, NULL);
+	close(manifest_pipe[0]);
+	close(manifest_pipe[1]);
+	close(manifest_inotify);
+	manifest_inotify = -1;
+}
 
-	DEBUG("xpath: %s", xpath);
+static int urifs_getattr(const char *path, struct stat *stbuf)
+{
+	DEBUG("args: const char *path = \"%s\", struct stat *stbuf = %p", path, stbuf)
+	unsigned epoch;
+	const uri_node *node = index_lookup(index_enter(&epoch), path);
 
-	xpathObj = xmlXPathEvalExpression((xmlChar*)xpath, fuse_get_context()->private_data);
-	xfree(xpath);
-	if(xpathObj == NULL)
+	if (!node)
 	{
+		index_leave(epoch);
+		DEBUG("Invalid path")
 		DEBUG("return: -ENOENT(%d)", -ENOENT)
 		return -ENOENT;
 	}
 
-	nodes = xpathObj->nodesetval;
+	DEBUG("%s", node->flags & NODE_DIR ? "dir" : "file")
+	index_stat(node, stbuf);
+	index_leave(epoch);
+	DEBUG("mode: %d", stbuf->st_mode)
 
-	if (nodes)
-	{
-		nb = nodes->nodeNr;
-		DEBUG("%d nodes found", nb)
+	DEBUG("return: 0")
+	return 0;
+}
 
-		filler(buf, ".", NULL, 0);
-		filler(buf, "..", NULL, 0);
-		for(i=0;i<nb;i++)
-		{
-			value = xmlGetProp(nodes->nodeTab[i], (xmlChar*)"name");
-			if(value)
-			{
-				filler(buf, (char*)value, NULL, 0);
-				xmlFree(value);
-			}
-		}
-		xmlXPathFreeObject(xpathObj);
-		DEBUG("return: 0")
-		return 0;
-	}
-	else
+static int urifs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
+{
+	(void)offset;
+	(void)fi;
+	DEBUG("args: const char *path = \"%s\", void *buf = %p, fuse_fill_dir_t filler = %p, off_t offset = %lu, int fi->fh = %lu", path, buf, filler, offset, fi->fh)
+	unsigned epoch;
+	uri_index *index = index_enter(&epoch);
+	const uri_node *node = index_lookup(index, path);
+	uint32_t child, end;
+
+	if (!node)
 	{
-		DEBUG("Invalid Xpath")
+		index_leave(epoch);
+		DEBUG("Invalid path")
+		DEBUG("return: -ENOENT(%d)", -ENOENT)
+		return -ENOENT;
 	}
 
-	xmlXPathFreeObject(xpathObj);
+	filler(buf, ".", NULL, 0);
+	filler(buf, "..", NULL, 0);
+	index_children(index, node, &child, &end);
+	for(; child < end; child++)
+		filler(buf, index_name(index, &index->nodes[child]), NULL, 0);
+	index_leave(epoch);
 
-	DEBUG("return: -ENOENT(%d)", -ENOENT)
-	return -ENOENT;
+	DEBUG("return: 0")
+	return 0;
 }
 
 static int urifs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
@@ -389,90 +2706,68 @@ static int urifs_create(const char *path, mode_t mode, struct fuse_file_info *fi
 static int urifs_open(const char *path, struct fuse_file_info *fi)
 {
 	DEBUG("args: const char *path = \"%s\", int fi->fh = %lu", path, fi->fh)
-	DEBUG("here")
-	int i = 0;
+	uint64_t handle;
 	uri_fd *fd = NULL;
-	xmlChar *value;
-	xmlNodeSetPtr nodes;
-	xmlNodePtr node;
-	xmlXPathObjectPtr xpathObj;
-
-	char *xpath = xpath_from_path(path);
-	if (!xpath)
+	char *cmd = NULL;
+	int64_t mtime = 0;
+	int copied = 0;
+	unsigned epoch;
+	uri_index *index = index_enter(&epoch);
+	const uri_node *node = index_lookup(index, path);
+	const char *uri = node ? index_string(index, node->uri) : NULL;
+	const char *header = node ? index_string(index, node->header) : NULL;
+
+	if (!node || !(node->flags & NODE_SIZE) || !uri)
 	{
+		index_leave(epoch);
+		DEBUG("no file found")
 		DEBUG("return: -ENOENT(%d)", -ENOENT)
 		return -ENOENT;
 	}
 
-	DEBUG("xpath: %s", xpath);
-
-	xpathObj = xmlXPathEvalExpression((xmlChar*)xpath, fuse_get_context()->private_data);
-	xfree(xpath);
-	if(xpathObj == NULL)
+	/* everything needed from the manifest is copied, the disk cache and the header-cmd can
+	 * take a while and a reload shouldn't wait for them */
+	fd = (uri_fd*)malloc(sizeof(uri_fd));
+	if (fd)
 	{
-		DEBUG("return: -ENOENT(%d)", -ENOENT)
-		return -ENOENT;
+		fd->uri = strdup(uri);
+		fd->size = node->size;
+		fd->header = NULL;
+		fd->refs = 1;
+		fd->closed = 0;
+		fd->last_block = -1;
+		fd->ahead = 0;
+		fd->window = 0;
+		fd->disk = NULL;
+		mtime = node->mtime;
+		if(header)
+		{
+			fd->header = curl_slist_append(fd->header,header);
+			DEBUG("Added header \"%s\"", header)
+		}
+		if(index_string(index, node->header_cmd))
+			cmd = strdup(index_string(index, node->header_cmd));
+		copied = fd->uri && (!header || fd->header) && (cmd || !index_string(index, node->header_cmd));
 	}
+	index_leave(epoch);
 
-	nodes = xpathObj->nodesetval;
-
-	if (nodes && nodes->nodeNr > 0)
+	if (copied)
 	{
-		DEBUG("%d nodes found", nodes->nodeNr)
-		node = nodes->nodeTab[0];
-
-		fd = (uri_fd*)malloc(sizeof(uri_fd));
-		if (fd)
+		if(disk_dir)
+			fd->disk = disk_open(fd->uri, fd->size, mtime);
+		if(cmd)
+			header_cmd(fd, cmd);
+		if(file_add(fd, &handle) == 0)
 		{
-			fd->uri = NULL;
-			fd->header = NULL;
-			value = xmlGetProp(node, (xmlChar*)"size");
-			if(value)
-			{
-				fd->size = atoll((char*)value);
-				xmlFree(value);
-				value = xmlGetProp(node, (xmlChar*)"uri");
-				if(value)
-				{
-					fd->uri = strdup((char*)value);
-					xmlFree(value);
-					if(fd->uri)
-					{
-						value = xmlGetProp(node, (xmlChar*)"header");
-						if(value)
-						{
-							fd->header = curl_slist_append(fd->header,(char*)value);
-							DEBUG("Added header \"%s\"", (char*)value)
-							xmlFree(value);
-						}
-						value = xmlGetProp(node, (xmlChar*)"header-cmd");
-						if(value)
-						{
-							header_cmd(fd, (char*)value);
-							xmlFree(value);
-						}
-						while((i < MAX_ENTRIES)&&(opened_files[i]))
-							i++;
-						if(i < MAX_ENTRIES)
-						{
-							fi->fh = i;
-							opened_files[i] = fd;
-							xmlXPathFreeObject(xpathObj);
-							DEBUG("return: 0")
-							return 0;
-						}
-						curl_slist_free_all(fd->header);
-						xfree(fd->uri);
-					}
-				}
-			}
-			xfree(fd);
+			xfree(cmd);
+			fi->fh = handle;
+			DEBUG("return: 0")
+			return 0;
 		}
 	}
-	else
-		DEBUG("0 node found")
-
-	xmlXPathFreeObject(xpathObj);
+	xfree(cmd);
+	if (fd)
+		uri_fd_free(fd);
 
 	DEBUG("return: -ENOENT(%d)", -ENOENT)
 	return -ENOENT;
@@ -483,12 +2778,9 @@ static int urifs_read(const char *path, char *buf, size_t size, off_t offset, st
 	(void)path;
 	DEBUG("args: const char *path = \"%s\", char *buf = %p, size_t size = %lu, off_t offset = %lu, int fi->fh = %lu", path, buf, size, offset, fi->fh)
 	size_t bytes;
+	ssize_t done;
+	off_t first, last;
 	uri_fd *fd;
-	char *range;
-	CURL *curl_handle;
-	CURLcode res;
-	struct curl_buffer buffer;
-	long http_code = 0;
 
 	if(size == 0)
 	{
@@ -496,7 +2788,7 @@ static int urifs_read(const char *path, char *buf, size_t size, off_t offset, st
 		return 0;
 	}
 
-	fd = opened_files[fi->fh];
+	fd = file_get(fi->fh);
 
 	if (!fd)
 	{
@@ -504,49 +2796,30 @@ static int urifs_read(const char *path, char *buf, size_t size, off_t offset, st
 		return -ENOENT;
 	}
 
+	if((size_t)offset >= fd->size)
+	{
+		DEBUG("return: 0")
+		return 0;
+	}
+
 	if((size + offset) >= fd->size)	{
 		bytes = fd->size - offset;
 	} else {
 		bytes = size;
 	}
 
-	if(asprintf(&range, "%llu-%llu", (unsigned long long)offset, (unsigned long long)offset+(unsigned long long)bytes-1) == -1)
-	{
-		DEBUG("return: -ENOENT(%d)", -ENOENT)
-		return -ENOENT;
-	}
-	DEBUG("Range: %s (bytes: %llu)", range, (unsigned long long)bytes);
-
-	curl_handle = curl_easy_init();
-	curl_easy_setopt(curl_handle, CURLOPT_URL, fd->uri);
-
-	curl_easy_setopt(curl_handle, CURLOPT_NOSIGNAL, 1);
-	curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, curl_get_callback);
-	curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, (void *)&buffer);
-	curl_easy_setopt(curl_handle, CURLOPT_RANGE, range);
-	curl_easy_setopt(curl_handle, CURLOPT_HTTPHEADER, fd->header);
-	curl_easy_setopt(curl_handle, CURLOPT_FAILONERROR, 1);
-
-	buffer.data = buf;
-	buffer.size = bytes;
-	buffer.read = 0;
-	res = curl_easy_perform(curl_handle);
-	curl_easy_getinfo (curl_handle, CURLINFO_RESPONSE_CODE, &http_code);
-	DEBUG("curl_easy_perform() HTTP code %li", http_code);
-	
-	if(res != CURLE_OK)
+	first = offset / (off_t)block_size;
+	last = (offset + (off_t)bytes - 1) / (off_t)block_size;
+	read_ahead(fd, first, last);
+	done = cache_read(fd, buf, offset, bytes);
+	if(done < 0)
 	{
-		DEBUG("curl_easy_perform() failed: %s (%s)", curl_easy_strerror(res),fd->uri);
-		curl_easy_cleanup(curl_handle);
-		xfree(range);
-		return -ENOENT;
+		DEBUG("return: -EIO(%d)", -EIO)
+		return -EIO;
 	}
 
-	curl_easy_cleanup(curl_handle);
-	xfree(range);
-
-	DEBUG("return: %lu", buffer.read)
-	return buffer.read;
+	DEBUG("return: %ld", done)
+	return done;
 }
 
 static int urifs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
@@ -575,17 +2848,21 @@ static int urifs_release(const char *path, struct fuse_file_info *fi)
 {
 	(void)path;
 	DEBUG("args: const char *path = \"%s\", int fi->fh = %lu", path, fi->fh)
-	if(fi->fh > MAX_ENTRIES)
+	uri_fd *fd;
+
+	DEBUG("closing file %lu",fi->fh)
+	fd = file_remove(fi->fh);
+	if(!fd)
 	{
 		DEBUG("return: -ENOENT(%d)", -ENOENT)
 		return -ENOENT;
 	}
 
-	DEBUG("closing file %lu",fi->fh)
-	curl_slist_free_all(opened_files[fi->fh]->header);
-	xfree(opened_files[fi->fh]->uri);
-	xfree(opened_files[fi->fh]);
-	opened_files[fi->fh] = NULL;
+	/* its queued prefetches are dropped, the last one frees it */
+	pthread_mutex_lock(&prefetch_lock);
+	fd->closed = 1;
+	pthread_mutex_unlock(&prefetch_lock);
+	uri_fd_put(fd);
 
 	DEBUG("return: 0")
 	return 0;
@@ -596,23 +2873,56 @@ void urifs_cleanup(void *data)
 	(void)data;
 	DEBUG("args: void *data = %p", data)
 	DEBUG("here")
-	xmlXPathContextPtr xpathCtx = fuse_get_context()->private_data;
-	xmlDocPtr doc = xpathCtx->doc;
 	int i;
-	for(i=0; i<MAX_ENTRIES; i++)
+
+	manifest_unwatch();
+	pthread_mutex_lock(&prefetch_lock);
+	prefetch_stop = 1;
+	pthread_cond_broadcast(&prefetch_queued);
+	pthread_mutex_unlock(&prefetch_lock);
+	for(i=0; i<PREFETCH_THREADS; i++)
+		pthread_join(prefetch_threads[i], NULL);
+	while(prefetch_head)
+	{
+		prefetch_job *job = prefetch_head;
+		prefetch_head = job->next;
+		uri_fd_put(job->fd);
+		xfree(job);
+	}
+
+	for(i=0; i<FILE_CHUNKS; i++)
+	{
+		if(file_chunks[i])
+		{
+			int j;
+			for(j=0; j<FILE_CHUNK; j++)
+				if(file_chunks[i][j].fd)
+					uri_fd_free(file_chunks[i][j].fd);
+			xfree(file_chunks[i]);
+			file_chunks[i] = NULL;
+		}
+	}
+	file_slots = 0;
+	file_free = FILE_NONE;
+
+	for(i=0; i<(int)cache_buckets; i++)
 	{
-		if(opened_files[i]!=NULL)
+		while(cache_table[i])
 		{
-			curl_slist_free_all(opened_files[i]->header);
-			xfree(opened_files[i]->uri);
-			xfree(opened_files[i]);
+			cache_block *block = cache_table[i];
+			cache_table[i] = block->hash_next;
+			cache_free(block);
 		}
 	}
-	xfree(opened_files);
+	xfree(cache_table);
+	disk_cleanup();
+	header_cleanup();
+	engine_cleanup();
+	share_cleanup();
 	curl_global_cleanup();
 
-	xmlXPathFreeContext(xpathCtx);
-	xmlFreeDoc(doc);
+	index_free(current_index);
+	current_index = NULL;
 	xmlCleanupParser();
 }
 
@@ -692,38 +3002,58 @@ void *urifs_init(struct fuse_conn_info *conn)
 	(void)conn;
 	DEBUG("args: struct fuse_conn_info *conn = %p", conn)
 	int i;
-	xmlDocPtr doc;
-	xmlXPathContextPtr xpathCtx;
 
 	DEBUG("mounting %s",source_xml)
 
 	xmlInitParser();
 	LIBXML_TEST_VERSION
 
-	doc = xmlParseFile(source_xml);
-
-	if (doc == NULL)
+	/* everything is in the index now, the hot path doesn't touch libxml2 */
+	current_index = index_load(source_xml);
+	if (current_index == NULL)
 	{
-		DEBUG("Can't parse %s", source_xml)
+		DEBUG("Can't load %s", source_xml)
 		exit(1);
 	}
 
-	xpathCtx = xmlXPathNewContext(doc);
-	if (xpathCtx == NULL)
+	cache_buckets = cache_size / block_size + 1;
+	cache_table = (cache_block**)calloc(cache_buckets, sizeof(cache_block*));
+	if (cache_table == NULL)
 	{
-		xmlFreeDoc(doc);
-		DEBUG("Can't get xmlXPathNewContext")
+		DEBUG("Can't allocate the block cache")
 		exit(1);
 	}
 
-	opened_files = (uri_fd**)malloc(sizeof(uri_fd*)*MAX_ENTRIES);
-	for(i=0;i<MAX_ENTRIES;i++)
-		opened_files[i] = NULL;
+	if(disk_dir)
+	{
+		disk_table = (disk_entry**)calloc(DISK_BUCKETS, sizeof(disk_entry*));
+		if (disk_table == NULL || (mkdir(disk_dir, 0700) != 0 && errno != EEXIST))
+		{
+			DEBUG("Can't use %s for the disk cache", disk_dir)
+			exit(1);
+		}
+		disk_scan();
+	}
 
 	curl_global_init(CURL_GLOBAL_ALL);
+	share_init();
+	engine_init();
+	header_init();
 
-	DEBUG("return: -ENOENT(%d)", -ENOENT)
-	return xpathCtx;
+	for(i=0;i<PREFETCH_THREADS;i++)
+	{
+		if(pthread_create(&prefetch_threads[i], NULL, prefetch_thread, NULL) != 0)
+		{
+			DEBUG("Can't start the prefetch threads")
+			exit(1);
+		}
+	}
+
+	manifest_watch();
+
+	/* the manifest is in current_index, it can change while mounted */
+	DEBUG("return: NULL")
+	return NULL;
 }
 
 static struct fuse_operations urifs_oper = {
@@ -761,12 +3091,53 @@ static int urifs_opt_proc(void *data, const char *arg, int key, struct fuse_args
 				return 0;
 			} else if(strcmp(arg, "-oallow-other") == 0) {
 				return 0;
+			} else if(strncmp(arg, "block_size=", 11) == 0) {
+				block_size = parse_size(arg+11);
+				DEBUG("block size: %lu", block_size)
+				return block_size > 0 ? 0 : -1;
+			} else if(strncmp(arg, "cache_size=", 11) == 0) {
+				cache_size = parse_size(arg+11);
+				DEBUG("cache size: %lu", cache_size)
+				return 0;
+			} else if(strncmp(arg, "readahead=", 10) == 0) {
+				readahead_size = parse_size(arg+10);
+				DEBUG("read-ahead: %lu", readahead_size)
+				return 0;
+			} else if(strncmp(arg, "header_ttl=", 11) == 0) {
+				header_ttl = atol(arg+11);
+				DEBUG("header-cmd ttl: %ld", header_ttl)
+				return header_ttl >= 0 ? 0 : -1;
+			} else if(strncmp(arg, "parallel=", 9) == 0) {
+				parallel = atoi(arg+9);
+				DEBUG("parallel ranges: %d", parallel)
+				return parallel > 0 && parallel <= MAX_LOAD ? 0 : -1;
+			} else if(strncmp(arg, "connections=", 12) == 0) {
+				host_connections = atol(arg+12);
+				DEBUG("connections per host: %ld", host_connections)
+				return host_connections > 0 ? 0 : -1;
+			} else if(strncmp(arg, "disk_cache=", 11) == 0) {
+				char *cwd = NULL;
+				/* fuse changes to / once it's mounted */
+				if(arg[11] == '/' || !(cwd = get_current_dir_name()))
+					disk_dir = strdup(arg+11);
+				else if(asprintf(&disk_dir, "%s/%s", cwd, arg+11) == -1)
+					disk_dir = NULL;
+				xfree(cwd);
+				DEBUG("disk cache: %s", disk_dir)
+				return disk_dir ? 0 : -1;
+			} else if(strncmp(arg, "disk_cache_size=", 16) == 0) {
+				disk_size = parse_size(arg+16);
+				DEBUG("disk cache size: %lu", disk_size)
+				return 0;
 			}
 			break;
 		case FUSE_OPT_KEY_NONOPT:
 			num++;
 			if(num == 1)	{
-				source_xml = strdup(arg);
+				/* it's watched and reloaded after fuse changed to / */
+				source_xml = realpath(arg, NULL);
+				if(!source_xml)
+					source_xml = strdup(arg);
 				return 0;
 			}
 			break;
@@ -774,6 +3145,55 @@ static int urifs_opt_proc(void *data, const char *arg, int key, struct fuse_args
 	return 1;
 }
 
+/* writes the compiled manifest of xml to out. it goes through a temporary file that's renamed
+ * over out, so a mount of out only ever reads a whole one */
+static int compile_manifest(const char *xml, const char *out)
+{
+	xmlDocPtr doc;
+	char *image;
+	char *tmp;
+	size_t size;
+	FILE *f;
+	int ret = -1;
+
+	xmlInitParser();
+	doc = xmlParseFile(xml);
+	if (doc == NULL)
+	{
+		fprintf(stderr, "Can't parse %s\n", xml);
+		return -1;
+	}
+	image = index_compile(doc, &size);
+	xmlFreeDoc(doc);
+	xmlCleanupParser();
+	if (image == NULL)
+	{
+		fprintf(stderr, "Can't compile %s\n", xml);
+		return -1;
+	}
+
+	if (asprintf(&tmp, "%s.tmp", out) == -1)
+	{
+		xfree(image);
+		return -1;
+	}
+	f = fopen(tmp, "wb");
+	if (f)
+	{
+		int written = fwrite(image, 1, size, f) == size;
+		if (fclose(f) == 0 && written && rename(tmp, out) == 0)
+			ret = 0;
+		else
+			unlink(tmp);
+	}
+	if (ret != 0)
+		fprintf(stderr, "Can't write %s\n", out);
+
+	xfree(tmp);
+	xfree(image);
+	return ret;
+}
+
 int main(int argc, char *argv[])
 {
 	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
@@ -782,6 +3202,9 @@ int main(int argc, char *argv[])
 		return -1;
 	}
 
+	if (argc == 4 && strcmp(argv[1], "--compile") == 0)
+		return compile_manifest(argv[2], argv[3]);
+
 	if(fuse_opt_parse(&args, NULL, NULL, urifs_opt_proc) == -1) {
 		return -1;
 	}